@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "block_cache.h"
+#include "disk_emu.h"
+
+/**
+ * One cached block
+ * block_no - the number of the block on disk, or -1 if the entry is unused
+ * dirty - 1 if the block was written since it was last read from or written to disk
+ * busy - ENTRY_READING or ENTRY_WRITING while a thread has the block's I/O in flight without cache_lock, else 0
+ * prev, next - neighbours in the LRU list (head is the most recently used)
+ * hash_next - next entry in the same hash bucket, or in the free list
+ */
+typedef struct {
+    int block_no;
+    int dirty;
+    int busy;
+    int prev;
+    int next;
+    int hash_next;
+} cache_entry_t;
+
+#define ENTRY_READING 1    // Being read from disk, so its data isn't there yet
+#define ENTRY_WRITING 2    // Being written to disk, so its data may be read but not changed
+
+#define NO_FREE_ENTRY -1   // get_free_entry found every entry busy
+#define LOCK_DROPPED -2    // get_free_entry let go of cache_lock to write an entry back, so look again
+#define WRITE_FAILED -3    // get_free_entry could not write back the entry it was to evict, which stays cached
+
+static int cache_capacity = 0;
+static int cache_block_size = 0;
+static int cache_used = 0;     // Entries 0 to cache_used - 1 have been handed out at least once
+
+static cache_entry_t *cache_entries = NULL;
+static char *cache_data = NULL;    // cache_capacity blocks, entry i owns cache_data + i * cache_block_size
+
+static int *cache_buckets = NULL;  // Hash table from block number to entry, chained through hash_next
+static int cache_num_buckets = 0;
+
+static int lru_head = -1;
+static int lru_tail = -1;
+static int free_list = -1;     // Entries in neither the LRU list nor the hash table: failed reads and written back evictions
+
+static int writes_in_flight = 0;   // Blocks being written back by evictions and flushes
+
+static cache_stats_t cache_stats;
+
+// Guards the cache's lists, tables and stats. It is let go of around disk I/O, while the entries involved are busy,
+// and cache_changed is broadcast whenever an entry stops being busy
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_changed = PTHREAD_COND_INITIALIZER;
+
+/*********************
+ * LRU and hash helpers
+ *********************/
+
+static char *entry_data(int e) {
+    return cache_data + (size_t)e * cache_block_size;
+}
+
+static int bucket_for_block(int block_no) {
+    return (unsigned int)block_no * 2654435761u % cache_num_buckets;
+}
+
+/**
+ * Returns the entry holding block_no, or -1 if it is not cached
+ */
+static int find_entry(int block_no) {
+    for (int e = cache_buckets[bucket_for_block(block_no)]; e != -1; e = cache_entries[e].hash_next) {
+        if (cache_entries[e].block_no == block_no) {
+            return e;
+        }
+    }
+    return -1;
+}
+
+static void unlink_from_lru(int e) {
+    if (cache_entries[e].prev != -1) {
+        cache_entries[cache_entries[e].prev].next = cache_entries[e].next;
+    } else {
+        lru_head = cache_entries[e].next;
+    }
+    if (cache_entries[e].next != -1) {
+        cache_entries[cache_entries[e].next].prev = cache_entries[e].prev;
+    } else {
+        lru_tail = cache_entries[e].prev;
+    }
+}
+
+/**
+ * Moves (or inserts) entry e to the front of the LRU list
+ */
+static void touch_entry(int e, int in_list) {
+    if (in_list) {
+        if (lru_head == e) {
+            return;
+        }
+        unlink_from_lru(e);
+    }
+    cache_entries[e].prev = -1;
+    cache_entries[e].next = lru_head;
+    if (lru_head != -1) {
+        cache_entries[lru_head].prev = e;
+    }
+    lru_head = e;
+    if (lru_tail == -1) {
+        lru_tail = e;
+    }
+}
+
+static void remove_from_hash(int e) {
+    int *p = &cache_buckets[bucket_for_block(cache_entries[e].block_no)];
+    while (*p != e) {
+        p = &cache_entries[*p].hash_next;
+    }
+    *p = cache_entries[e].hash_next;
+}
+
+/**
+ * Makes entry e, which is in neither the LRU list nor the hash table, the clean and most recently used copy of block_no
+ */
+static void add_entry(int e, int block_no) {
+    cache_entries[e].block_no = block_no;
+    int b = bucket_for_block(block_no);
+    cache_entries[e].hash_next = cache_buckets[b];
+    cache_buckets[b] = e;
+    touch_entry(e, 0);
+    cache_entries[e].dirty = 0;
+    cache_entries[e].busy = 0;
+}
+
+/**
+ * Drops entry e's block from the cache, and keeps the entry aside so it is handed out before any other
+ */
+static void discard_entry(int e) {
+    unlink_from_lru(e);
+    remove_from_hash(e);
+    cache_entries[e].hash_next = free_list;
+    free_list = e;
+}
+
+/**
+ * Returns an entry that can hold a new block, unlinked from both the LRU list and the hash table: a discarded or
+ * never used one if there is one, otherwise the least recently used entry that isn't busy. A dirty entry is written
+ * back first, with cache_lock let go of, and then LOCK_DROPPED is returned as other threads may have changed the
+ * cache meanwhile; the entry is on the free list for the next call. If the write fails, the entry stays cached
+ * and dirty, moved to the front of the LRU list, and WRITE_FAILED is returned. Returns NO_FREE_ENTRY if every
+ * entry is busy.
+ * Called with cache_lock held
+ */
+static int get_free_entry() {
+    if (free_list != -1) {
+        int e = free_list;
+        free_list = cache_entries[e].hash_next;
+        return e;
+    }
+    if (cache_used < cache_capacity) {
+        return cache_used++;
+    }
+    int e = lru_tail;
+    while (e != -1 && cache_entries[e].busy) {
+        e = cache_entries[e].prev;
+    }
+    if (e == -1) {
+        return NO_FREE_ENTRY;
+    }
+    if (cache_entries[e].dirty) {
+        int block_no = cache_entries[e].block_no;
+        cache_entries[e].dirty = 0;
+        cache_entries[e].busy = ENTRY_WRITING;
+        writes_in_flight++;
+        pthread_mutex_unlock(&cache_lock);
+        int result = write_blocks(block_no, 1, entry_data(e));
+        pthread_mutex_lock(&cache_lock);
+        writes_in_flight--;
+        cache_entries[e].busy = 0;
+        pthread_cond_broadcast(&cache_changed);
+        if (result < 0) {
+            // The cached copy is the only one, so keep it, and don't try it again first
+            cache_entries[e].dirty = 1;
+            touch_entry(e, 1);
+            return WRITE_FAILED;
+        }
+        cache_stats.writebacks++;
+        discard_entry(e);
+        return LOCK_DROPPED;
+    }
+    unlink_from_lru(e);
+    remove_from_hash(e);
+    return e;
+}
+
+/**
+ * Places a copy of block_no in the cache (or overwrites the cached one) and marks it dirty
+ * Returns 0, or -1 if no entry could be freed for it as a write-back failed
+ */
+static int install_block(int block_no, const void *data) {
+    for (;;) {
+        int e = find_entry(block_no);
+        if (e != -1 && cache_entries[e].busy) {
+            pthread_cond_wait(&cache_changed, &cache_lock);
+            continue;
+        }
+        if (e != -1) {
+            touch_entry(e, 1);
+        } else {
+            e = get_free_entry();
+            if (e == WRITE_FAILED) {
+                return -1;
+            }
+            if (e == NO_FREE_ENTRY) {
+                pthread_cond_wait(&cache_changed, &cache_lock);
+            }
+            if (e < 0) {
+                continue;
+            }
+            add_entry(e, block_no);
+        }
+        memcpy(entry_data(e), data, cache_block_size);
+        cache_stats.bytes_copied += cache_block_size;
+        cache_entries[e].dirty = 1;
+        return 0;
+    }
+}
+
+/**
+ * Returns the entry holding block_no, bringing the block into the cache first if it isn't there. A missing block
+ * is read from disk, or if fresh is set (the block holds no data yet), zero-filled instead. If writing is set the
+ * caller will change the block, so it also waits for the block to finish being written back
+ * Returns -1 if the block could not be read, or no entry could be freed for it as a write-back failed
+ */
+static int get_entry_for_block(int block_no, int fresh, int writing) {
+    for (;;) {
+        int e = find_entry(block_no);
+        if (e != -1 && (cache_entries[e].busy == ENTRY_READING || (writing && cache_entries[e].busy))) {
+            pthread_cond_wait(&cache_changed, &cache_lock);
+            continue;
+        }
+        if (e != -1) {
+            touch_entry(e, 1);
+            cache_stats.hits++;
+            // The block may still be cached from before it was freed and handed out again
+            if (fresh) {
+                memset(entry_data(e), 0, cache_block_size);
+            }
+            return e;
+        }
+        e = get_free_entry();
+        if (e == WRITE_FAILED) {
+            return -1;
+        }
+        if (e == NO_FREE_ENTRY) {
+            pthread_cond_wait(&cache_changed, &cache_lock);
+        }
+        if (e < 0) {
+            continue;
+        }
+        add_entry(e, block_no);
+        if (fresh) {
+            memset(entry_data(e), 0, cache_block_size);
+            return e;
+        }
+        cache_entries[e].busy = ENTRY_READING;
+        pthread_mutex_unlock(&cache_lock);
+        int result = read_blocks(block_no, 1, entry_data(e));
+        pthread_mutex_lock(&cache_lock);
+        cache_entries[e].busy = 0;
+        pthread_cond_broadcast(&cache_changed);
+        if (result < 0) {
+            discard_entry(e);
+            return -1;
+        }
+        cache_stats.misses++;
+        cache_stats.disk_reads++;
+        return e;
+    }
+}
+
+static int compare_entries_by_block(const void *a, const void *b) {
+    return cache_entries[*(const int *) a].block_no - cache_entries[*(const int *) b].block_no;
+}
+
+/*********************
+ * API
+ *********************/
+
+/**
+ * Sets up an empty cache of capacity blocks of block_size bytes, discarding any previous cache
+ * Returns 0 on success and -1 if memory could not be allocated
+ */
+int init_block_cache(int capacity, int block_size) {
+    free_block_cache();
+    cache_capacity = capacity;
+    cache_block_size = block_size;
+    cache_num_buckets = 2 * capacity;
+    cache_entries = malloc(sizeof(cache_entry_t) * capacity);
+    cache_data = malloc((size_t)capacity * block_size);
+    cache_buckets = malloc(sizeof(int) * cache_num_buckets);
+    if (cache_entries == NULL || cache_data == NULL || cache_buckets == NULL) {
+        printf("Error: Could not allocate a block cache of %d blocks.\n", capacity);
+        free_block_cache();
+        return -1;
+    }
+    for (int i = 0; i < cache_num_buckets; i++) {
+        cache_buckets[i] = -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the number of the i'th block of a read: block_nos[i], or start_address + i if block_nos is NULL
+ */
+static int block_of_read(const unsigned int *block_nos, int start_address, int i) {
+    return (block_nos != NULL) ? (int) block_nos[i] : start_address + i;
+}
+
+/**
+ * Reads nblocks blocks into buffer, block i going to buffer + i * cache_block_size. Blocks are numbered by
+ * block_of_read, and if block_nos is given its entries of 0 are skipped. If buffer is NULL the blocks are only
+ * brought into the cache. Hits are copied out of the cache, and each miss gets an entry, marked ENTRY_READING, that
+ * it is read straight into. The misses are read in batches with cache_lock let go of: a batch ends at a block
+ * another thread is reading, or when no entry is free, and each run of consecutive block numbers in it becomes one
+ * read request. Every request of a batch is submitted before any is waited for, so the disk sees all of them at
+ * once. The read stops early if an entry can't be freed because its write-back failed. Called with cache_lock held
+ * Returns the number of blocks read from disk, or -1 on error
+ */
+static int read_through_cache(const unsigned int *block_nos, int start_address, int nblocks, char *buf) {
+    int *batch = NULL;     // The entries of the batch, in the order of their blocks in the read
+    int *batch_pos = NULL; // Where each of them is in the read
+    struct iovec *iovs = NULL;
+    disk_request_t *requests = NULL;
+    int fetched = 0;
+    int write_failed = 0;
+    for (int i = 0; i < nblocks && !write_failed; ) {
+        int num_batch = 0;
+        while (i < nblocks) {
+            int block_no = block_of_read(block_nos, start_address, i);
+            if (block_nos != NULL && block_no == 0) {
+                i++;
+                continue;
+            }
+            int e = find_entry(block_no);
+            if (e != -1 && cache_entries[e].busy == ENTRY_READING) {
+                break;
+            }
+            if (e != -1) {
+                if (buf != NULL) {
+                    memcpy(buf + (size_t)i * cache_block_size, entry_data(e), cache_block_size);
+                    cache_stats.bytes_copied += cache_block_size;
+                    cache_stats.hits++;
+                    touch_entry(e, 1);
+                }
+                i++;
+                continue;
+            }
+            e = get_free_entry();
+            if (e == LOCK_DROPPED) {
+                continue;
+            }
+            if (e == WRITE_FAILED) {
+                write_failed = 1;
+                fetched = -1;
+            }
+            if (e < 0) {
+                break;
+            }
+            if (batch == NULL) {
+                batch = malloc(sizeof(int) * nblocks);
+                batch_pos = malloc(sizeof(int) * nblocks);
+                iovs = malloc(sizeof(struct iovec) * nblocks);
+                requests = malloc(sizeof(disk_request_t) * nblocks);
+            }
+            add_entry(e, block_no);
+            cache_entries[e].busy = ENTRY_READING;
+            batch[num_batch] = e;
+            batch_pos[num_batch] = i;
+            num_batch++;
+            i++;
+        }
+        if (num_batch == 0) {
+            // Stopped at a block another thread is reading, or with every entry busy, so wait for one to be done
+            if (i < nblocks && !write_failed) {
+                pthread_cond_wait(&cache_changed, &cache_lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_unlock(&cache_lock);
+        disk_queue_t queue = { 0, 0, NULL };
+        int num_requests = 0;
+        for (int k = 0; k < num_batch; ) {
+            int block_no = cache_entries[batch[k]].block_no;
+            int run = 1;
+            while (k + run < num_batch && run < DISK_MAX_IOVECS
+                   && cache_entries[batch[k + run]].block_no == block_no + run) {
+                run++;
+            }
+            for (int j = 0; j < run; j++) {
+                iovs[k + j].iov_base = entry_data(batch[k + j]);
+                iovs[k + j].iov_len = cache_block_size;
+            }
+            disk_request_t *request = &requests[num_requests++];
+            request->write = 0;
+            request->start_address = block_no;
+            request->nblocks = run;
+            request->buffer = NULL;
+            request->iovs = &iovs[k];
+            request->iovcnt = run;
+            if (submit_request(&queue, request) == -1) {
+                request->result = -1;
+            }
+            k += run;
+        }
+        reap_requests(&queue, queue.in_flight);
+        pthread_mutex_lock(&cache_lock);
+
+        for (int r = 0; r < num_requests; r++) {
+            disk_request_t *request = &requests[r];
+            int first = request->iovs - iovs;
+            if (request->result >= 0) {
+                cache_stats.disk_reads++;
+                fetched = (fetched == -1) ? -1 : fetched + request->nblocks;
+            } else {
+                fetched = -1;
+            }
+            for (int k = first; k < first + request->nblocks; k++) {
+                cache_entries[batch[k]].busy = 0;
+                if (request->result < 0) {
+                    discard_entry(batch[k]);
+                } else if (buf != NULL) {
+                    memcpy(buf + (size_t)batch_pos[k] * cache_block_size, entry_data(batch[k]), cache_block_size);
+                    cache_stats.bytes_copied += cache_block_size;
+                    cache_stats.misses++;
+                }
+            }
+        }
+        pthread_cond_broadcast(&cache_changed);
+    }
+    free(requests);
+    free(iovs);
+    free(batch_pos);
+    free(batch);
+    return fetched;
+}
+
+/**
+ * Reads nblocks blocks starting at start_address into buffer, serving what it can from the cache.
+ * Consecutive misses are read from disk with a single request.
+ * Returns the number of blocks read, or -1 on error
+ */
+int cached_read_blocks(int start_address, int nblocks, void *buffer) {
+    pthread_mutex_lock(&cache_lock);
+    int result = read_through_cache(NULL, start_address, nblocks, buffer);
+    pthread_mutex_unlock(&cache_lock);
+    return (result == -1) ? -1 : nblocks;
+}
+
+/**
+ * Reads the blocks numbered in block_nos, which need not be consecutive, into consecutive blocks of buffer.
+ * Entries of 0 are skipped, and their blocks of buffer left as they are. The misses are all sent to disk before
+ * any of them is waited for.
+ * Returns nblocks, or -1 on error
+ */
+int cached_read_list(const unsigned int *block_nos, int nblocks, void *buffer) {
+    pthread_mutex_lock(&cache_lock);
+    int result = read_through_cache(block_nos, 0, nblocks, buffer);
+    pthread_mutex_unlock(&cache_lock);
+    return (result == -1) ? -1 : nblocks;
+}
+
+/**
+ * Brings nblocks blocks starting at start_address into the cache without copying them anywhere else, so that
+ * later reads of them are hits. Each run of blocks that aren't cached yet is read with a single request, all of
+ * them submitted at once, and blocks that are already cached are left as they are.
+ * Returns the number of blocks read from disk, or -1 on error
+ */
+int cached_prefetch_blocks(int start_address, int nblocks) {
+    pthread_mutex_lock(&cache_lock);
+    int fetched = read_through_cache(NULL, start_address, nblocks, NULL);
+    pthread_mutex_unlock(&cache_lock);
+    return fetched;
+}
+
+/**
+ * Writes nblocks blocks starting at start_address from buffer into the cache. The blocks are marked dirty
+ * and only reach the disk on eviction or flush_block_cache.
+ * Returns the number of blocks written, or -1 if a block couldn't be given an entry as a write-back failed
+ */
+int cached_write_blocks(int start_address, int nblocks, const void *buffer) {
+    const char *buf = buffer;
+    int result = nblocks;
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < nblocks && result != -1; i++) {
+        if (install_block(start_address + i, buf + (size_t)i * cache_block_size) == -1) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+/**
+ * Copies len bytes starting at byte offset of block block_no into buffer, without copying the rest of the block
+ * Returns len, or -1 on error
+ */
+int cached_read_bytes(int block_no, int offset, int len, void *buffer) {
+    pthread_mutex_lock(&cache_lock);
+    int e = get_entry_for_block(block_no, 0, 0);
+    if (e != -1) {
+        memcpy(buffer, entry_data(e) + offset, len);
+        cache_stats.bytes_copied += len;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (e == -1) ? -1 : len;
+}
+
+/**
+ * Copies len bytes from buffer into block block_no starting at byte offset, leaving the rest of the block as it is,
+ * and marks the block dirty. If fresh is set, the block holds no data yet and the rest of it is zero-filled
+ * instead of being read from disk.
+ * Returns len, or -1 on error
+ */
+int cached_write_bytes(int block_no, int offset, int len, const void *buffer, int fresh) {
+    pthread_mutex_lock(&cache_lock);
+    int e = get_entry_for_block(block_no, fresh, 1);
+    if (e != -1) {
+        memcpy(entry_data(e) + offset, buffer, len);
+        cache_stats.bytes_copied += len;
+        cache_entries[e].dirty = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (e == -1) ? -1 : len;
+}
+
+/**
+ * Writes every dirty block to disk in block-number order, with one write request per run of
+ * consecutive block numbers, gathered from the cached copies without copying them. All of the requests are
+ * submitted before any is waited for, with cache_lock let go of and the blocks marked ENTRY_WRITING, so they can
+ * still be read meanwhile. Blocks that fail to be written stay dirty. Returns once evictions' write-backs that were
+ * in flight are done too.
+ * Returns the number of blocks written, or -1 on error
+ */
+int flush_block_cache() {
+    if (cache_entries == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache_lock);
+    int *dirty = malloc(sizeof(int) * cache_capacity);
+    int num_dirty = 0;
+    for (int e = 0; e < cache_used; e++) {
+        if (cache_entries[e].dirty) {
+            dirty[num_dirty++] = e;
+        }
+    }
+    qsort(dirty, num_dirty, sizeof(int), compare_entries_by_block);
+
+    // Each run is written straight from the cached blocks, gathered by one iovec per block
+    struct iovec *iovs = malloc((num_dirty + 1) * sizeof(struct iovec));
+    disk_request_t *requests = malloc((num_dirty + 1) * sizeof(disk_request_t));
+    int num_requests = 0;
+    for (int i = 0; i < num_dirty; ) {
+        int run = 1;
+        while (i + run < num_dirty && run < DISK_MAX_IOVECS
+               && cache_entries[dirty[i + run]].block_no == cache_entries[dirty[i]].block_no + run) {
+            run++;
+        }
+        for (int j = 0; j < run; j++) {
+            iovs[i + j].iov_base = entry_data(dirty[i + j]);
+            iovs[i + j].iov_len = cache_block_size;
+            cache_entries[dirty[i + j]].dirty = 0;
+            cache_entries[dirty[i + j]].busy = ENTRY_WRITING;
+        }
+        disk_request_t *request = &requests[num_requests++];
+        request->write = 1;
+        request->start_address = cache_entries[dirty[i]].block_no;
+        request->nblocks = run;
+        request->buffer = NULL;
+        request->iovs = &iovs[i];
+        request->iovcnt = run;
+        i += run;
+    }
+    writes_in_flight += num_dirty;
+    pthread_mutex_unlock(&cache_lock);
+
+    disk_queue_t queue = { 0, 0, NULL };
+    for (int r = 0; r < num_requests; r++) {
+        if (submit_request(&queue, &requests[r]) == -1) {
+            requests[r].result = -1;
+        }
+    }
+    reap_requests(&queue, queue.in_flight);
+
+    pthread_mutex_lock(&cache_lock);
+    int result = num_dirty;
+    for (int r = 0; r < num_requests; r++) {
+        int first = requests[r].iovs - iovs;
+        for (int j = first; j < first + requests[r].nblocks; j++) {
+            cache_entries[dirty[j]].busy = 0;
+            if (requests[r].result < 0) {
+                cache_entries[dirty[j]].dirty = 1;
+            }
+        }
+        if (requests[r].result < 0) {
+            result = -1;
+        } else {
+            cache_stats.writebacks += requests[r].nblocks;
+        }
+    }
+    writes_in_flight -= num_dirty;
+    pthread_cond_broadcast(&cache_changed);
+    while (writes_in_flight > 0) {
+        pthread_cond_wait(&cache_changed, &cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(requests);
+    free(iovs);
+    free(dirty);
+    return result;
+}
+
+/**
+ * Releases the cache's memory. Dirty blocks are dropped, so flush first if they matter
+ */
+void free_block_cache() {
+    free(cache_entries);
+    free(cache_data);
+    free(cache_buckets);
+    cache_entries = NULL;
+    cache_data = NULL;
+    cache_buckets = NULL;
+    cache_capacity = 0;
+    cache_used = 0;
+    lru_head = -1;
+    lru_tail = -1;
+    free_list = -1;
+    writes_in_flight = 0;
+    memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
+cache_stats_t get_cache_stats() {
+    pthread_mutex_lock(&cache_lock);
+    cache_stats_t stats = cache_stats;
+    pthread_mutex_unlock(&cache_lock);
+    return stats;
+}
@@ -0,0 +1,36 @@
+#ifndef _INCLUDE_BLOCK_CACHE_H_
+#define _INCLUDE_BLOCK_CACHE_H_
+
+/**
+ * A fixed-size, write-back LRU cache of disk blocks that sits between sfs_api and disk_emu.
+ * cached_read_blocks and cached_write_blocks take the same arguments as read_blocks and write_blocks.
+ * cached_read_list reads blocks that need not be consecutive, sending all of its misses to disk at once.
+ * cached_read_bytes and cached_write_bytes copy part of one block, straight to or from the cached copy.
+ * cached_prefetch_blocks reads blocks into the cache ahead of time, for readahead.
+ * Dirty blocks only reach the disk when they are evicted or when flush_block_cache is called.
+ * Reads of several runs of misses, prefetches and flushes go through disk_emu's asynchronous interface, so all of
+ * their runs are in flight at once.
+ * All calls except init_block_cache and free_block_cache may be made from several threads at once.
+ * Disk I/O is done without the cache's lock, so a thread only waits for another's I/O if it wants the same block.
+ */
+
+typedef struct {
+    long hits;          // Block reads served from the cache
+    long misses;        // Block reads that had to go to disk
+    long disk_reads;    // read_blocks calls made for misses and prefetches
+    long writebacks;    // Dirty blocks written to disk, on eviction or flush
+    long bytes_copied;  // Bytes memcpy'd into and out of cached blocks
+} cache_stats_t;
+
+int init_block_cache(int capacity, int block_size);
+int cached_read_blocks(int start_address, int nblocks, void *buffer);
+int cached_write_blocks(int start_address, int nblocks, const void *buffer);
+int cached_read_list(const unsigned int *block_nos, int nblocks, void *buffer);
+int cached_read_bytes(int block_no, int offset, int len, void *buffer);
+int cached_write_bytes(int block_no, int offset, int len, const void *buffer, int fresh);
+int cached_prefetch_blocks(int start_address, int nblocks);
+int flush_block_cache();
+void free_block_cache();
+cache_stats_t get_cache_stats();
+
+#endif //_INCLUDE_BLOCK_CACHE_H_
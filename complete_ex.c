@@ -6,10 +6,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
@@ -17,10 +19,54 @@
 
 FILE* log_fd;
 
+// sfs_fopen hands out one fd per file, however many times it is opened, so count the FUSE handles
+// sharing each fd and only sfs_fclose it when the last one is released
+int *open_handles; // FD_TABLE_SIZE of them, allocated once the file system is made
+pthread_mutex_t open_handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Opens filename with sfs_fopen and stores the fd in fi->fh, for read, write and release to use
+ */
+static int open_handle(const char *filename, struct fuse_file_info *fi)
+{
+    pthread_mutex_lock(&open_handles_lock);
+    int fd = sfs_fopen((char *) filename);
+    if (fd != -1) {
+        open_handles[fd]++;
+        fi->fh = fd;
+    }
+    pthread_mutex_unlock(&open_handles_lock);
+    return fd;
+}
+
+/*
+ * Gives back a handle open_handle took, sfs_fclosing the fd once no handle is left on it
+ */
+static void close_handle(struct fuse_file_info *fi)
+{
+    pthread_mutex_lock(&open_handles_lock);
+    if (--open_handles[fi->fh] == 0) {
+        sfs_fclose(fi->fh);
+    }
+    pthread_mutex_unlock(&open_handles_lock);
+}
+
+/*
+ * Empties the file behind a handle that was just opened with O_TRUNC, giving the handle back if that fails
+ */
+static int truncate_on_open(struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_TRUNC) && sfs_ftruncate(fi->fh, 0) == -1) {
+        close_handle(fi);
+        return -EIO;
+    }
+    return 0;
+}
+
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
-    int size;
+    int64_t size;
 
     fprintf(log_fd, "xmp_getattr:: path = %s\n", path);
     fflush(log_fd);
@@ -86,88 +132,125 @@ static int xmp_open(const char *path, struct fuse_file_info *fi)
         strcpy(filename, &path[1]);
         fprintf(log_fd, "xmp_open:: filename = %s\n", filename);
         fflush(log_fd);
-	res = sfs_fopen(filename);
+	res = open_handle(filename, fi);
 	if (res == -1) {
       printf("Open error\n");
-      return -errno;
+      return -EIO;
   }
-
-  sfs_fclose(res);
-	return 0;
+	return truncate_on_open(fi);
 }
 static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi)
 {
-	int fd;
 	int res;
 
-  char filename[MAXFILENAME];
-
-  strcpy(filename, &path[1]);
-  fprintf(log_fd, "xmp_read:: filename = %s\n", filename);
+  fprintf(log_fd, "xmp_read:: path = %s\n", path);
   fflush(log_fd);
-	fd = sfs_fopen(filename);
-	if (fd == -1) {
-    fprintf(log_fd, "open error in xmp_read\n");
-    fflush(log_fd);
-    return -errno;
-  }
-  if(sfs_fseek(fd, offset) == -1) {
-    return -errno;
-  }
-	res = sfs_fread(fd, buf, size);
+  // Read at FUSE's offset directly, through the fd xmp_open kept open, rather than looking the file up again
+	res = sfs_pread(fi->fh, buf, size, offset);
 	if (res == -1) {
     fprintf(log_fd, "read error in xmp_read\n");
     fflush(log_fd);
-    res = -errno;
+    res = -EIO;
+  } else {
+    fprintf(log_fd, "Data read: %.*s\n", res, buf);
+    fflush(log_fd);
   }
-  fprintf(log_fd, "Data read: %s\n", buf);
-  fflush(log_fd);
-	sfs_fclose(fd);
 	return res;
 }
 static int xmp_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
-	int fd;
 	int res;
 
-	char filename[MAXFILENAME];
-
-  strcpy(filename, &path[1]);
-  fd = sfs_fopen(filename);
-	if (fd == -1) {
-      fprintf(log_fd, "xmp_write::why is this not working??\n");
-      fflush(log_fd);
-      return -errno;
-  }
-  fprintf(log_fd, "xmp_write:: filename = %s\n", filename);
+  fprintf(log_fd, "xmp_write:: path = %s\n", path);
   fflush(log_fd);
-	res = sfs_fwrite(fd, buf, size);
+  // Write at FUSE's offset, through the fd xmp_open or xmp_create kept open
+	res = sfs_pwrite(fi->fh, buf, size, offset);
 	if (res == -1) {
-    res = -errno;
+    res = -EIO;
   }
-	sfs_fclose(fd);
 	return res;
 }
+static int xmp_release(const char *path, struct fuse_file_info *fi)
+{
+    fprintf(log_fd, "xmp_release:: path = %s\n", path);
+    fflush(log_fd);
+
+    close_handle(fi);
+    return 0;
+}
+static int xmp_flush(const char *path, struct fuse_file_info *fi)
+{
+    // Called on every close(2) of a handle: give the file's buffered appends their blocks
+    fprintf(log_fd, "xmp_flush:: path = %s\n", path);
+    fflush(log_fd);
+
+    if (sfs_fflush(fi->fh) == -1)
+        return -EIO;
+    return 0;
+}
+static int xmp_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    fprintf(log_fd, "xmp_fsync:: path = %s\n", path);
+    fflush(log_fd);
+
+    // How durable this makes the file's writes depends on the durability mode the file system was mounted with
+    if (sfs_fsync(fi->fh) == -1)
+        return -EIO;
+    return 0;
+}
+static int xmp_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    fprintf(log_fd, "xmp_fallocate:: path = %s, mode = %d\n", path, mode);
+    fflush(log_fd);
+
+    // Only hole punching is supported; preallocation would just be writing zeros
+    if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+    if (sfs_punch_hole(fi->fh, offset, length) == -1)
+        return -EIO;
+    return 0;
+}
 static int xmp_truncate(const char *path, off_t size)
 {
         char filename[MAXFILENAME];
-        int fd;
+        int fd, res;
 
         strcpy(filename, &path[1]);
 
         fprintf(log_fd, "xmp_truncate:: filename = %s\n", path);
         fflush(log_fd);
 
-        fd = sfs_remove(filename);
-	if (fd == -1)
-		return -errno;
+        // sfs_fopen would make a file that isn't there
+        if (sfs_getfilesize(filename) == -1)
+                return -ENOENT;
 
+        // Truncate through the file's fd, which is the one any handles open on the file share, so they see the
+        // new size, and only close it again if no handle has it open
+        pthread_mutex_lock(&open_handles_lock);
         fd = sfs_fopen(filename);
-        sfs_fclose(fd);
+        if (fd == -1) {
+                pthread_mutex_unlock(&open_handles_lock);
+                return -EIO;
+        }
+        res = sfs_ftruncate(fd, size);
+        if (open_handles[fd] == 0)
+                sfs_fclose(fd);
+        pthread_mutex_unlock(&open_handles_lock);
+        if (res == -1)
+                return -EIO;
         return 0;
 }
+static int xmp_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    fprintf(log_fd, "xmp_ftruncate:: path = %s\n", path);
+    fflush(log_fd);
+
+    if (sfs_ftruncate(fi->fh, size) == -1)
+        return -EIO;
+    return 0;
+}
 static int xmp_access(const char *path, int mask)
 {
         fprintf(log_fd, "xmp_access:: pathname = %s\n", path);
@@ -190,10 +273,10 @@ static int xmp_create (const char *path, mode_t mode, struct fuse_file_info *fp)
     fprintf(log_fd, "xmp_create:: filename = %s\n", path);
     fflush(log_fd);
 
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
-
-    return 0;
+    fd = open_handle(filename, fp);
+    if (fd == -1)
+        return -EIO;
+    return truncate_on_open(fp);
 }
 static struct fuse_operations xmp_oper = {
 	.getattr = xmp_getattr,
@@ -201,17 +284,28 @@ static struct fuse_operations xmp_oper = {
 	.mknod = xmp_mknod,
 	.unlink = xmp_unlink, //done
 	.truncate = xmp_truncate,
+  .ftruncate = xmp_ftruncate,
 	.open = xmp_open, //done
 	.read = xmp_read, //done
 	.write = xmp_write, //done
   .access = xmp_access,
   .create = xmp_create,
-//	.release = sfs_fclose,
+  .release = xmp_release,
+  .flush = xmp_flush,
+  .fsync = xmp_fsync,
+  .fallocate = xmp_fallocate,
 };
 
 int main(int argc, char *argv[])
 {
+  // SFS_DURABILITY=none, sync or write picks how durable disk writes are made, see sfs_set_durability
+  const char *durability = getenv("SFS_DURABILITY");
+  if (durability != NULL && strcmp(durability, "none") == 0)
+      sfs_set_durability(DISK_DURABILITY_NONE);
+  else if (durability != NULL && strcmp(durability, "write") == 0)
+      sfs_set_durability(DISK_DURABILITY_EVERY_WRITE);
 	mksfs(1);
+  open_handles = calloc(FD_TABLE_SIZE, sizeof(int));
   log_fd = fopen("log.txt", "w");
 
   if(log_fd == NULL) {
@@ -219,5 +313,10 @@ int main(int argc, char *argv[])
       return 0;
   }
 
-	return fuse_main(argc, argv, &xmp_oper, NULL);
+  // sfs_api is thread-safe, so let FUSE run its default multithreaded loop (don't pass -s)
+	int res = fuse_main(argc, argv, &xmp_oper, NULL);
+
+  // Write back whatever is still sitting in the block cache before exiting
+  sfs_sync();
+	return res;
 }
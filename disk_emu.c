@@ -1,185 +1,1027 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <time.h>
-#include "disk_emu.h"
-
-
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
-
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
-{
-    if(NULL != fp)
-    {
-        fclose(fp);
-    }
-    return 0;
-}
-
-/*
- * Initializes a disk file filled with 0's
- */
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
-{
-    int i, j;
-
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
-    }
-
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
-    return 0;
-}
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
-{
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not open %s\n\n", filename);
-        return -1;
-    }
-    return 0;
-}
-
-/*-------------------------------------------------------------------*/
-/* Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error %d\n", start_address);
-        return -1;
-    }
-
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);
-
-        }
-    }
-
-
-    free(blockRead);
-
-
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
-
-/*------------------------------------------------------------------
- * Writes a series of blocks to the disk from the buffer
- * start_address is the starting block, nblocks is the number of blocks to write,
- * starting with the starting block, buffer contains the contents to write to the blocks
- *------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error\n");
-        return -1;
-    }
-
-    /*Goto where the data is to be written on the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-
-        fflush(fp);
-
-        s++;
-    }
-    free(blockWrite);
-
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
+/*Make off_t 64 bits even on 32-bit systems, so disks can be bigger than 2 GB*/
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "disk_emu.h"
+
+/*io_uring is used through its system calls, so it needs nothing beyond the kernel headers*/
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE   /*linux/fs.h, which io_uring.h includes, has a BLOCK_SIZE of its own*/
+#define HAVE_IO_URING 1
+#endif
+
+
+FILE* fp = NULL;
+double p;
+double r;
+int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+
+/*How durable writes are made, for disks initialized after set_disk_durability*/
+int durability = DISK_DURABILITY_ON_SYNC;
+
+/*Which backend read_blocks/write_blocks go through, and the mapping used by DISK_BACKEND_MMAP*/
+int backend = DISK_BACKEND_STDIO;
+char* disk_map = NULL;
+size_t disk_map_len = 0;
+
+/*The device being modelled, see set_device_model, and its state. Every field is guarded by device_lock*/
+static int device_on = 0;
+static device_model_t device;
+static double device_clock = 0;         /*Seconds on a virtual clock*/
+static double device_epoch = 0;         /*Real time the clock was started at, without a virtual clock*/
+static double device_slots[DEVICE_MAX_QUEUE_DEPTH];  /*When each of the requests the device serves at once is done*/
+static double device_bus_free = 0;      /*When the last transfer ends, as requests share the bandwidth*/
+static long long device_head = 0;       /*Block just past the last request, where a seek is measured from*/
+static device_stats_t device_stats;
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*State of the asynchronous interface. Every field is guarded by async_lock*/
+static int async_engine = DISK_ASYNC_NONE;
+static int async_depth = 1;             /*Most requests in flight at once, across all queues*/
+static int async_in_flight = 0;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;   /*Signalled when requests complete*/
+
+/*DISK_ASYNC_THREADS: requests waiting for a thread, oldest first*/
+static pthread_t* async_threads = NULL;
+static int async_num_threads = 0;
+static int async_stopping = 0;
+static disk_request_t* pending_head = NULL;
+static disk_request_t* pending_tail = NULL;
+static pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;   /*Signalled when a request is queued for a thread*/
+
+#ifdef HAVE_IO_URING
+/*DISK_ASYNC_URING: the rings shared with the kernel*/
+static int ring_fd = -1;
+static void* sq_ring = MAP_FAILED;
+static void* cq_ring = MAP_FAILED;
+static struct io_uring_sqe* sqes = MAP_FAILED;
+static size_t sq_ring_len, cq_ring_len, sqes_len;
+static unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe* cqes;
+static int ring_unsubmitted = 0;    /*Requests in the submission ring the kernel hasn't been told about yet*/
+static int ring_reaping = 0;        /*1 while a thread waits in io_uring_enter, without async_lock*/
+#endif
+
+/*----------------------------------------------------------*/
+/*Maps the opened disk file into memory for DISK_BACKEND_MMAP*/
+/*----------------------------------------------------------*/
+static int map_disk()
+{
+    disk_map_len = (size_t)BLOCK_SIZE * MAX_BLOCK;
+    disk_map = mmap(NULL, disk_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    if (disk_map == MAP_FAILED)
+    {
+        printf("Could not map the disk file into memory\n\n");
+        disk_map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int close_disk()
+{
+    stop_async_io();
+    if(NULL != disk_map)
+    {
+        munmap(disk_map, disk_map_len);
+        disk_map = NULL;
+    }
+    if(NULL != fp)
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Makes every write so far as durable as the durability mode asks: forces them to stable storage with
+ * DISK_DURABILITY_ON_SYNC, and does nothing with the other modes, where they are never forced or already were
+ */
+int sync_disk()
+{
+    if (durability != DISK_DURABILITY_ON_SYNC)
+    {
+        return 0;
+    }
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        if (NULL != disk_map && msync(disk_map, disk_map_len, MS_SYNC) == -1)
+        {
+            printf("Could not sync the disk mapping\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (NULL != fp && fdatasync(fileno(fp)) == -1)
+    {
+        printf("Could not sync the disk file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sets how durable writes are made, for disks initialized from now on:
+ * DISK_DURABILITY_NONE - writes reach the operating system, and are never forced to stable storage
+ * DISK_DURABILITY_ON_SYNC - sync_disk forces every write so far to stable storage
+ * DISK_DURABILITY_EVERY_WRITE - each write is on stable storage when it returns (the file is opened O_DSYNC)
+ */
+void set_disk_durability(int mode)
+{
+    durability = mode;
+}
+
+/*Opens the disk file, emptied first if fresh, and with O_DSYNC if every write is to be durable*/
+static FILE* open_disk_file(char *filename, int fresh)
+{
+    int flags = O_RDWR | (fresh ? O_CREAT | O_TRUNC : 0) | ((durability == DISK_DURABILITY_EVERY_WRITE) ? O_DSYNC : 0);
+    int fd = open(filename, flags, 0644);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    FILE* file = fdopen(fd, fresh ? "w+b" : "r+b");
+    if (file == NULL)
+    {
+        close(fd);
+    }
+    return file;
+}
+
+/*
+ * Initializes a disk file of num_blocks blocks that all read as 0's.
+ * The file is sized with ftruncate, so it starts out sparse and making it takes the same time whatever its size.
+ */
+int init_fresh_disk(char *filename, int block_size, int num_blocks, int disk_backend)
+{
+    /*Set up failure at 10%*/
+    p = -1.f;
+    /*Set up max retry attempts after failure to 3*/
+    MAX_RETRY = 3;
+
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+    /*Creates a new file*/
+    fp = open_disk_file(filename, 1);
+
+    if (fp == NULL)
+    {
+        printf("Could not create new disk file %s\n\n", filename);
+        return -1;
+    }
+
+    /*Extends the emptied file to its given size, without writing the 0's*/
+    if (ftruncate(fileno(fp), (off_t)BLOCK_SIZE * MAX_BLOCK) == -1)
+    {
+        printf("Could not size new disk file %s\n\n", filename);
+        fclose(fp);
+        fp = NULL;
+        return -1;
+    }
+
+    backend = disk_backend;
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        return map_disk();
+    }
+    return 0;
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+int init_disk(char *filename, int block_size, int num_blocks, int disk_backend)
+{
+    /*Set up failure at 10%*/
+    p = -1.f;
+    /*Set up max retry attempts after failure to 3*/
+    MAX_RETRY = 3;
+
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+
+    /*Opens a file*/
+    fp = open_disk_file(filename, 0);
+
+    if (fp == NULL)
+    {
+        printf("Could not open %s\n\n", filename);
+        return -1;
+    }
+
+    backend = disk_backend;
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        return map_disk();
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/* Device model                                                       */
+/*-------------------------------------------------------------------*/
+
+/*A 7200 rpm disk: a seek plus half a rotation for any jump, one head, and 150 MB/s once there*/
+const device_model_t DEVICE_HDD = { 4.5e-3, 1e-6, 12e-3, 50e-6, 150e6, 1, 1 };
+/*A SATA SSD: no seeks, a fixed cost per request, and 32 requests served at once sharing 500 MB/s*/
+const device_model_t DEVICE_SSD = { 0, 0, 0, 80e-6, 500e6, 32, 1 };
+
+/*Returns the time in seconds from a monotonic clock*/
+static double monotonic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*Returns the time on the device's clock: simulated with a virtual clock, real otherwise. Called with device_lock held*/
+static double device_now()
+{
+    return device.virtual_clock ? device_clock : monotonic_now() - device_epoch;
+}
+
+/*Returns the time on the device's clock*/
+static double device_time()
+{
+    pthread_mutex_lock(&device_lock);
+    double now = device_now();
+    pthread_mutex_unlock(&device_lock);
+    return now;
+}
+
+/*
+ * Works out when the device would finish a request for nblocks blocks starting at start_address, made now: it waits
+ * for the first of the device's queue_depth slots to be free, pays the request overhead and a seek from wherever the
+ * last request left the head, then transfers its bytes once the bandwidth is free of earlier requests.
+ * Returns the time on the device's clock the request finishes at
+ */
+static double schedule_request(int start_address, int nblocks)
+{
+    pthread_mutex_lock(&device_lock);
+    double now = device_now();
+    int slot = 0;
+    for (int i = 1; i < device.queue_depth; i++)
+    {
+        if (device_slots[i] < device_slots[slot])
+        {
+            slot = i;
+        }
+    }
+    double begin = (device_slots[slot] > now) ? device_slots[slot] : now;
+    long long distance = llabs((long long)start_address - device_head);
+    double seek = 0;
+    if (distance != 0)
+    {
+        seek = device.seek_min + distance * device.seek_per_block;
+        if (seek > device.seek_max)
+        {
+            seek = device.seek_max;
+        }
+        device_stats.seeks++;
+        device_stats.seek_time += seek;
+    }
+    double ready = begin + device.request_overhead + seek;
+    double transfer = (device.bandwidth > 0) ? (double)nblocks * BLOCK_SIZE / device.bandwidth : 0;
+    double finish = ((device_bus_free > ready) ? device_bus_free : ready) + transfer;
+    device_bus_free = finish;
+    device_slots[slot] = finish;
+    device_head = (long long)start_address + nblocks;
+    device_stats.requests++;
+    pthread_mutex_unlock(&device_lock);
+    return finish;
+}
+
+/*Waits until the device's clock reads finish: moves a virtual clock on to it, or sleeps*/
+static void wait_until(double finish)
+{
+    pthread_mutex_lock(&device_lock);
+    if (device.virtual_clock)
+    {
+        if (device_clock < finish)
+        {
+            device_clock = finish;
+        }
+        pthread_mutex_unlock(&device_lock);
+        return;
+    }
+    double left = finish - device_now();
+    pthread_mutex_unlock(&device_lock);
+    if (left > 0)
+    {
+        struct timespec ts = { (time_t)left, (long)((left - (time_t)left) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * Makes every request to the disk cost what it would on the given device, or stops modelling a device if model is
+ * NULL. Starts the device's clock at 0 and clears its statistics
+ */
+void set_device_model(const device_model_t *model)
+{
+    pthread_mutex_lock(&device_lock);
+    device_on = (model != NULL);
+    if (model != NULL)
+    {
+        device = *model;
+        if (device.queue_depth < 1)
+        {
+            device.queue_depth = 1;
+        }
+        if (device.queue_depth > DEVICE_MAX_QUEUE_DEPTH)
+        {
+            device.queue_depth = DEVICE_MAX_QUEUE_DEPTH;
+        }
+    }
+    pthread_mutex_unlock(&device_lock);
+    reset_device_clock();
+}
+
+/*Starts the device's clock again at 0, with the device idle, and clears its statistics*/
+void reset_device_clock()
+{
+    pthread_mutex_lock(&device_lock);
+    device_clock = 0;
+    device_epoch = monotonic_now();
+    device_bus_free = 0;
+    memset(device_slots, 0, sizeof(device_slots));
+    memset(&device_stats, 0, sizeof(device_stats));
+    pthread_mutex_unlock(&device_lock);
+}
+
+/*Returns the device's statistics, and the time on its clock*/
+device_stats_t get_device_stats()
+{
+    pthread_mutex_lock(&device_lock);
+    device_stats_t stats = device_stats;
+    stats.elapsed = device_on ? device_now() : 0;
+    pthread_mutex_unlock(&device_lock);
+    return stats;
+}
+
+/*-------------------------------------------------------------------*/
+/* Reads a series of blocks from the disk file into the buffer        */
+/*-------------------------------------------------------------------*/
+static int read_disk(int start_address, int nblocks, void *buffer)
+{
+    int e, s;
+    e = 0;
+    s = 0;
+
+    /*With the mapped backend the whole request is a single copy out of the mapping*/
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        memcpy(buffer, disk_map + (size_t)start_address * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    /*Read the whole request at its own offset, so concurrent calls never share a file position*/
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    if (pread(fileno(fp), buffer, len, (off_t)start_address * BLOCK_SIZE) != (ssize_t)len)
+    {
+        printf("read error at block %d\n", start_address);
+        return -1;
+    }
+    s = nblocks;
+
+    /*If no failure return the number of blocks read, else return the negative number of failures*/
+    if (e == 0)
+        return s;
+    else
+        return e;
+}
+
+/*With the mapped backend, forces the pages a write touched to stable storage if every write has to be durable.
+ Returns nblocks, or -1 on error*/
+static int sync_mapped(int start_address, int nblocks)
+{
+    if (durability == DISK_DURABILITY_EVERY_WRITE)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t first = (size_t)start_address * BLOCK_SIZE / page * page;
+        size_t end = (size_t)(start_address + nblocks) * BLOCK_SIZE;
+        if (msync(disk_map + first, end - first, MS_SYNC) == -1)
+        {
+            printf("write error at block %d\n", start_address);
+            return -1;
+        }
+    }
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/* Writes a series of blocks to the disk file from the buffer         */
+/*-------------------------------------------------------------------*/
+static int write_disk(int start_address, int nblocks, void *buffer)
+{
+    int e, s;
+    e = 0;
+    s = 0;
+
+    /*With the mapped backend the whole request is a single copy into the mapping; sync_disk makes it durable,
+     unless every write has to be, in which case the pages it touched are synced straight away*/
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        memcpy(disk_map + (size_t)start_address * BLOCK_SIZE, buffer, (size_t)nblocks * BLOCK_SIZE);
+        return sync_mapped(start_address, nblocks);
+    }
+
+    /*Write the whole request at its own offset, so concurrent calls never share a file position*/
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    if (pwrite(fileno(fp), buffer, len, (off_t)start_address * BLOCK_SIZE) != (ssize_t)len)
+    {
+        printf("write error at block %d\n", start_address);
+        return -1;
+    }
+    s = nblocks;
+
+    /*If no failure return the number of blocks written, else return the negative number of failures*/
+    if (e == 0)
+        return s;
+    else
+        return e;
+}
+
+/*-------------------------------------------------------------------*/
+/* Reads a series of blocks from the disk file into the buffers of    */
+/* iov, filling each before moving on to the next                     */
+/*-------------------------------------------------------------------*/
+static int read_disk_v(int start_address, int nblocks, const struct iovec *iov, int iovcnt)
+{
+    size_t offset = (size_t)start_address * BLOCK_SIZE;
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(iov[i].iov_base, disk_map + offset, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        return nblocks;
+    }
+
+    /*One system call for the whole request, however many buffers it is spread over*/
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    if (preadv(fileno(fp), iov, iovcnt, (off_t)offset) != (ssize_t)len)
+    {
+        printf("read error at block %d\n", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/* Writes a series of blocks to the disk file from the buffers of     */
+/* iov, one after the other                                           */
+/*-------------------------------------------------------------------*/
+static int write_disk_v(int start_address, int nblocks, const struct iovec *iov, int iovcnt)
+{
+    size_t offset = (size_t)start_address * BLOCK_SIZE;
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(disk_map + offset, iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        return sync_mapped(start_address, nblocks);
+    }
+
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    if (pwritev(fileno(fp), iov, iovcnt, (off_t)offset) != (ssize_t)len)
+    {
+        printf("write error at block %d\n", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*Checks that the buffers of iov add up to exactly nblocks blocks, and that there aren't more of them than one
+ system call takes. Returns 0 if so, or -1*/
+static int check_iov(int nblocks, const struct iovec *iov, int iovcnt)
+{
+    if (iovcnt < 1 || iovcnt > DISK_MAX_IOVECS)
+    {
+        printf("bad buffer count %d\n", iovcnt);
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    if (len != (size_t)nblocks * BLOCK_SIZE)
+    {
+        printf("buffers hold %zu bytes, not %d blocks\n", len, nblocks);
+        return -1;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/* Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 0 || (long long)start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*Takes as long as the device being modelled would*/
+    if (device_on)
+    {
+        wait_until(schedule_request(start_address, nblocks));
+    }
+    return read_disk(start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------
+ * Writes a series of blocks to the disk from the buffer
+ * start_address is the starting block, nblocks is the number of blocks to write,
+ * starting with the starting block, buffer contains the contents to write to the blocks
+ *------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 0 || (long long)start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*Takes as long as the device being modelled would*/
+    if (device_on)
+    {
+        wait_until(schedule_request(start_address, nblocks));
+    }
+    return write_disk(start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------
+ * Reads a series of blocks from the disk into several buffers, in a single request: the first iov[0].iov_len bytes
+ * go to iov[0].iov_base, the next to iov[1].iov_base and so on. The buffers must add up to exactly nblocks blocks,
+ * and there can be at most DISK_MAX_IOVECS of them
+ *------------------------------------------------------------------*/
+int read_blocks_v(int start_address, int nblocks, const struct iovec *iov, int iovcnt)
+{
+    if (start_address < 0 || nblocks < 0 || (long long)start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    if (check_iov(nblocks, iov, iovcnt) == -1)
+    {
+        return -1;
+    }
+
+    /*The device sees one request, however many buffers it is spread over*/
+    if (device_on)
+    {
+        wait_until(schedule_request(start_address, nblocks));
+    }
+    return read_disk_v(start_address, nblocks, iov, iovcnt);
+}
+
+/*------------------------------------------------------------------
+ * Writes a series of blocks to the disk from several buffers, in a single request, as read_blocks_v reads them
+ *------------------------------------------------------------------*/
+int write_blocks_v(int start_address, int nblocks, const struct iovec *iov, int iovcnt)
+{
+    if (start_address < 0 || nblocks < 0 || (long long)start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+    if (check_iov(nblocks, iov, iovcnt) == -1)
+    {
+        return -1;
+    }
+
+    if (device_on)
+    {
+        wait_until(schedule_request(start_address, nblocks));
+    }
+    return write_disk_v(start_address, nblocks, iov, iovcnt);
+}
+
+/*-------------------------------------------------------------------*/
+/* Asynchronous interface                                             */
+/*-------------------------------------------------------------------*/
+
+/*
+ * Records that the I/O of a request is over, with the given result, and wakes whoever waits for it. The request
+ * joins its queue's finished list, in the order the device being modelled finishes them, until it is reaped.
+ * Called with async_lock held
+ */
+static void complete_request(disk_request_t *request, int result)
+{
+    request->result = result;
+    disk_request_t **p = &request->queue->finished;
+    while (*p != NULL && (*p)->finish <= request->finish)
+    {
+        p = &(*p)->next;
+    }
+    request->next = *p;
+    *p = request;
+    request->queue->completed++;
+    async_in_flight--;
+    pthread_cond_broadcast(&async_done);
+}
+
+/*Carries out a request on the disk file. Its cost on the device being modelled was worked out when it was submitted*/
+static int do_request(disk_request_t *request)
+{
+    int result;
+    if (request->iovcnt != 0)
+    {
+        result = request->write
+            ? write_disk_v(request->start_address, request->nblocks, request->iovs, request->iovcnt)
+            : read_disk_v(request->start_address, request->nblocks, request->iovs, request->iovcnt);
+    }
+    else
+    {
+        result = request->write
+            ? write_disk(request->start_address, request->nblocks, request->buffer)
+            : read_disk(request->start_address, request->nblocks, request->buffer);
+    }
+    return (result < 0) ? -1 : result;
+}
+
+/*Takes requests off the pending list and carries them out, until stop_async_io*/
+static void* async_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&async_lock);
+    while (1)
+    {
+        while (pending_head == NULL && !async_stopping)
+        {
+            pthread_cond_wait(&async_work, &async_lock);
+        }
+        if (pending_head == NULL)
+        {
+            break;
+        }
+        disk_request_t *request = pending_head;
+        pending_head = request->next;
+        if (pending_head == NULL)
+        {
+            pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&async_lock);
+        int result = do_request(request);
+        pthread_mutex_lock(&async_lock);
+        complete_request(request, result);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+/*Releases the rings, whichever of them were set up*/
+static void free_ring()
+{
+    if (sqes != MAP_FAILED)
+    {
+        munmap(sqes, sqes_len);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_len);
+    }
+    if (sq_ring != MAP_FAILED)
+    {
+        munmap(sq_ring, sq_ring_len);
+    }
+    if (ring_fd != -1)
+    {
+        close(ring_fd);
+    }
+    sqes = MAP_FAILED;
+    cq_ring = MAP_FAILED;
+    sq_ring = MAP_FAILED;
+    ring_fd = -1;
+    ring_unsubmitted = 0;
+}
+
+/*Sets up an io_uring with room for entries requests. Returns 0, or -1 if the kernel doesn't allow it*/
+static int setup_ring(int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+    {
+        ring_fd = -1;
+        return -1;
+    }
+    sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    /*Newer kernels map both rings with a single mmap*/
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_ring_len > sq_ring_len)
+        {
+            sq_ring_len = cq_ring_len;
+        }
+        cq_ring_len = sq_ring_len;
+    }
+    sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        free_ring();
+        return -1;
+    }
+    cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring
+        : mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        free_ring();
+        return -1;
+    }
+    sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+/*Puts a request in the submission ring. The kernel is told about it the next time a thread waits for completions*/
+static void queue_on_ring(disk_request_t *request)
+{
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    request->iov.iov_base = request->buffer;
+    request->iov.iov_len = (size_t)request->nblocks * BLOCK_SIZE;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fileno(fp);
+    if (request->iovcnt != 0)
+    {
+        sqe->addr = (uintptr_t)request->iovs;
+        sqe->len = request->iovcnt;
+    }
+    else
+    {
+        sqe->addr = (uintptr_t)&request->iov;
+        sqe->len = 1;
+    }
+    sqe->off = (off_t)request->start_address * BLOCK_SIZE;
+    sqe->user_data = (uintptr_t)request;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring_unsubmitted++;
+}
+
+/*Submits the queued requests and waits for at least one completion, then completes every request the kernel has
+ finished. Called with async_lock held, which is let go while waiting*/
+static void reap_ring()
+{
+    int to_submit = ring_unsubmitted;
+    ring_unsubmitted = 0;
+    ring_reaping = 1;
+    pthread_mutex_unlock(&async_lock);
+    /*If the wait is interrupted the requests are still submitted, and a later wait picks up their completions*/
+    syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    pthread_mutex_lock(&async_lock);
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        disk_request_t *request = (disk_request_t *)(uintptr_t)cqe->user_data;
+        if (cqe->res != (int)request->iov.iov_len)
+        {
+            printf("%s error at block %d\n", request->write ? "write" : "read", request->start_address);
+        }
+        complete_request(request, (cqe->res == (int)request->iov.iov_len) ? request->nblocks : -1);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    ring_reaping = 0;
+    pthread_cond_broadcast(&async_done);
+}
+#endif
+
+/*Waits for at least one request in flight to complete. Called with async_lock held*/
+static void wait_for_completion()
+{
+#ifdef HAVE_IO_URING
+    if (async_engine == DISK_ASYNC_URING && !ring_reaping)
+    {
+        reap_ring();
+        return;
+    }
+#endif
+    pthread_cond_wait(&async_done, &async_lock);
+}
+
+/*
+ * Starts the asynchronous interface with the given engine, allowing queue_depth requests in flight at once.
+ * If io_uring can't be used the thread pool is, and if no threads can be made requests are carried out as they are
+ * submitted. Call it after the disk is initialized; close_disk stops it.
+ * Returns the engine in use
+ */
+int init_async_io(int engine, int queue_depth)
+{
+    stop_async_io();
+    pthread_mutex_lock(&async_lock);
+    async_depth = (queue_depth < 1) ? 1 : queue_depth;
+    if (engine == DISK_ASYNC_URING)
+    {
+#ifdef HAVE_IO_URING
+        if (setup_ring(async_depth) == 0)
+        {
+            async_engine = DISK_ASYNC_URING;
+            pthread_mutex_unlock(&async_lock);
+            return async_engine;
+        }
+#endif
+        printf("io_uring is not available, using a thread pool for asynchronous I/O\n");
+        engine = DISK_ASYNC_THREADS;
+    }
+    if (engine == DISK_ASYNC_THREADS)
+    {
+        async_threads = malloc(sizeof(pthread_t) * async_depth);
+        while (async_threads != NULL && async_num_threads < async_depth
+               && pthread_create(&async_threads[async_num_threads], NULL, async_worker, NULL) == 0)
+        {
+            async_num_threads++;
+        }
+        if (async_num_threads > 0)
+        {
+            async_engine = DISK_ASYNC_THREADS;
+        }
+    }
+    pthread_mutex_unlock(&async_lock);
+    return async_engine;
+}
+
+/*
+ * Stops the asynchronous interface, once every request in flight has completed. Requests submitted afterwards are
+ * carried out as they are submitted
+ */
+void stop_async_io()
+{
+    pthread_mutex_lock(&async_lock);
+    while (async_in_flight > 0)
+    {
+        wait_for_completion();
+    }
+    async_stopping = 1;
+    pthread_cond_broadcast(&async_work);
+    pthread_mutex_unlock(&async_lock);
+    for (int i = 0; i < async_num_threads; i++)
+    {
+        pthread_join(async_threads[i], NULL);
+    }
+    pthread_mutex_lock(&async_lock);
+    free(async_threads);
+    async_threads = NULL;
+    async_num_threads = 0;
+    async_stopping = 0;
+#ifdef HAVE_IO_URING
+    if (async_engine == DISK_ASYNC_URING)
+    {
+        free_ring();
+    }
+#endif
+    async_engine = DISK_ASYNC_NONE;
+    pthread_mutex_unlock(&async_lock);
+}
+
+/*
+ * Queues a read or write of request->nblocks blocks starting at request->start_address, to or from request->buffer.
+ * Waits first if the most requests allowed are already in flight. The request completes some time before a
+ * reap_requests call on the same queue counts it
+ * Returns 0, or -1 if the blocks are out of range
+ */
+int submit_request(disk_queue_t *queue, disk_request_t *request)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (request->start_address < 0 || request->nblocks < 0 || (long long)request->start_address + request->nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", request->start_address);
+        return -1;
+    }
+    if (request->iovcnt != 0 && check_iov(request->nblocks, request->iovs, request->iovcnt) == -1)
+    {
+        return -1;
+    }
+    request->queue = queue;
+    request->done = 0;
+    request->next = NULL;
+    request->finish = device_on ? schedule_request(request->start_address, request->nblocks) : 0;
+
+    pthread_mutex_lock(&async_lock);
+    while (async_engine != DISK_ASYNC_NONE && async_in_flight >= async_depth)
+    {
+        wait_for_completion();
+    }
+    async_in_flight++;
+    queue->in_flight++;
+    if (async_engine == DISK_ASYNC_THREADS)
+    {
+        if (pending_tail != NULL)
+        {
+            pending_tail->next = request;
+        }
+        else
+        {
+            pending_head = request;
+        }
+        pending_tail = request;
+        pthread_cond_signal(&async_work);
+    }
+#ifdef HAVE_IO_URING
+    else if (async_engine == DISK_ASYNC_URING)
+    {
+        queue_on_ring(request);
+    }
+#endif
+    else
+    {
+        pthread_mutex_unlock(&async_lock);
+        /*Carried out now, so the caller waits out the device's time for it too*/
+        if (device_on)
+        {
+            wait_until(request->finish);
+        }
+        int result = do_request(request);
+        pthread_mutex_lock(&async_lock);
+        complete_request(request, result);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return 0;
+}
+
+/*
+ * Waits until at least min_complete of the requests submitted on queue have completed since the last reap (or all of
+ * them, if fewer are in flight), and reaps every one that has: each has done set and its result filled in.
+ * With a device model, a request completes when the device would have finished it, not when its I/O is over.
+ * Returns the number of requests reaped
+ */
+int reap_requests(disk_queue_t *queue, int min_complete)
+{
+    pthread_mutex_lock(&async_lock);
+    if (min_complete > queue->in_flight)
+    {
+        min_complete = queue->in_flight;
+    }
+    while (queue->completed < min_complete)
+    {
+        wait_for_completion();
+    }
+    if (device_on && min_complete > 0)
+    {
+        disk_request_t *request = queue->finished;
+        for (int i = 1; i < min_complete; i++)
+        {
+            request = request->next;
+        }
+        double finish = request->finish;
+        pthread_mutex_unlock(&async_lock);
+        wait_until(finish);
+        pthread_mutex_lock(&async_lock);
+    }
+    double now = device_on ? device_time() : 0;
+    int reaped = 0;
+    while (queue->finished != NULL && queue->finished->finish <= now)
+    {
+        disk_request_t *request = queue->finished;
+        queue->finished = request->next;
+        request->done = 1;
+        reaped++;
+    }
+    queue->completed -= reaped;
+    queue->in_flight -= reaped;
+    pthread_mutex_unlock(&async_lock);
+    return reaped;
+}
@@ -1,5 +1,90 @@
-int init_fresh_disk(char *filename, int block_size, int num_blocks);
-int init_disk(char *filename, int block_size, int num_blocks);
+#ifndef _INCLUDE_DISK_EMU_H_
+#define _INCLUDE_DISK_EMU_H_
+
+#include <sys/uio.h>
+
+/*Backends for read_blocks/write_blocks, chosen when the disk is initialized*/
+#define DISK_BACKEND_STDIO 0    /*pread/pwrite on the disk file, at an offset given per call*/
+#define DISK_BACKEND_MMAP 1     /*memcpy against a shared mapping of the disk file, made durable with sync_disk*/
+
+/*Durability modes, see set_disk_durability*/
+#define DISK_DURABILITY_NONE 0          /*Writes are never forced to stable storage*/
+#define DISK_DURABILITY_ON_SYNC 1       /*sync_disk forces every write so far to stable storage*/
+#define DISK_DURABILITY_EVERY_WRITE 2   /*Each write is on stable storage when it returns*/
+
+void set_disk_durability(int mode);
+int init_fresh_disk(char *filename, int block_size, int num_blocks, int disk_backend);
+int init_disk(char *filename, int block_size, int num_blocks, int disk_backend);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+#define DISK_MAX_IOVECS 1024    /*Most buffers one vectored read or write can have, as preadv and pwritev take on Linux*/
+int read_blocks_v(int start_address, int nblocks, const struct iovec *iov, int iovcnt);
+int write_blocks_v(int start_address, int nblocks, const struct iovec *iov, int iovcnt);
+int sync_disk();
 int close_disk();
+
+/*Engines for the asynchronous interface, chosen with init_async_io*/
+#define DISK_ASYNC_NONE 0       /*Requests are carried out as they are submitted*/
+#define DISK_ASYNC_URING 1      /*io_uring, where the kernel has it*/
+#define DISK_ASYNC_THREADS 2    /*A pool of threads calling read_blocks/write_blocks*/
+
+/*One asynchronous read or write. The caller fills in the first six fields and keeps the request in place until it is done*/
+typedef struct disk_request
+{
+    int write;                  /*1 to write the blocks from buffer, 0 to read them into buffer*/
+    int start_address;
+    int nblocks;
+    void *buffer;
+    const struct iovec *iovs;   /*If iovcnt isn't 0, the blocks are scattered over these buffers instead of buffer,*/
+    int iovcnt;                 /*as with read_blocks_v/write_blocks_v*/
+    int result;                 /*Set on completion: nblocks, or -1 on error*/
+    int done;                   /*Set to 1 on completion*/
+    struct disk_queue *queue;   /*The rest is disk_emu's*/
+    struct disk_request *next;
+    struct iovec iov;
+    double finish;              /*When the device being modelled finishes the request*/
+} disk_request_t;
+
+/*The requests one caller has submitted, so that several threads can each reap their own completions*/
+typedef struct disk_queue
+{
+    int in_flight;  /*Submitted and not yet reaped*/
+    int completed;  /*Completed and not yet reaped*/
+    struct disk_request *finished;  /*The completed ones, in the order the device finishes them*/
+} disk_queue_t;
+
+int init_async_io(int engine, int queue_depth);
+void stop_async_io();
+int submit_request(disk_queue_t *queue, disk_request_t *request);
+int reap_requests(disk_queue_t *queue, int min_complete);
+
+/*A device for every disk request to cost the time of, see set_device_model. Times are in seconds*/
+#define DEVICE_MAX_QUEUE_DEPTH 256
+typedef struct
+{
+    double seek_min;            /*Seek paid by a request that doesn't start where the last one ended*/
+    double seek_per_block;      /*Added to a seek for every block between the two*/
+    double seek_max;            /*Longest a seek takes*/
+    double request_overhead;    /*Paid by every request*/
+    double bandwidth;           /*Bytes per second, shared by the requests being served, or 0 for no limit*/
+    int queue_depth;            /*Requests served at once*/
+    int virtual_clock;          /*1 to only add up the time on a simulated clock, 0 to really wait for it*/
+} device_model_t;
+
+/*What a device has done since its clock was started*/
+typedef struct
+{
+    long requests;
+    long seeks;
+    double seek_time;           /*Spent seeking*/
+    double elapsed;             /*On the device's clock: simulated with a virtual clock, real otherwise*/
+} device_stats_t;
+
+extern const device_model_t DEVICE_HDD;
+extern const device_model_t DEVICE_SSD;
+
+void set_device_model(const device_model_t *model);
+void reset_device_clock();
+device_stats_t get_device_stats();
+
+#endif //_INCLUDE_DISK_EMU_H_
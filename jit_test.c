@@ -46,8 +46,8 @@ int main(int argc, char* argv[]) {
 
   	    printf("%s\n", out_data2);
 
-        printf("The size of file 1 is: %d\n", sfs_getfilesize("/some_name.txt"));
-        printf("The size of file 2 is: %d\n", sfs_getfilesize("keith.txt"));
+        printf("The size of file 1 is: %lld\n", (long long) sfs_getfilesize("/some_name.txt"));
+        printf("The size of file 2 is: %lld\n", (long long) sfs_getfilesize("keith.txt"));
 
         char filename[30];
         while(sfs_getnextfilename(filename)) {
@@ -80,5 +80,6 @@ int main(int argc, char* argv[]) {
   	    sfs_fclose(f2);
         printf("Passed old disk test!\n");
     }
+    sfs_sync();
     close_disk();
 }
@@ -2,35 +2,393 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>    // for `ffs`
+#include <endian.h>     // for `le64toh`
+#include <pthread.h>
+#include <limits.h>
 #include "sfs_api.h"
 #include "disk_emu.h"
+#include "block_cache.h"
 
-#define NUM_BIT_MAP_BLOCKS (sizeof(free_bit_map) / BLOCK_SZ + 1)  // Number of blocks needed to store the bitmap
-// In-memory cached data structures
+#define SFS_MAGIC 0xACBD0007  // Marks block 0 of a disk as a superblock. The low half is the version of the disk layout
+#define NUM_BIT_MAP_BLOCKS (BIT_MAP_SIZE / BLOCK_SZ + 1)  // Number of blocks needed to store the bitmap
+#define NUM_BIT_MAP_BITS (BIT_MAP_SIZE * 8)  // Number of blocks tracked by the bitmap
+#define NUM_BIT_MAP_WORDS (BIT_MAP_SIZE / 8)  // Number of whole 64-bit words in the bitmap
+#define BLOCK_CLEAN 0     // States of a block of in-memory metadata, see dirty_inode_blocks
+#define BLOCK_UNLOGGED 1
+#define BLOCK_LOGGED 2
+#define DIR_HASH_SIZE (2 * MAX_DIRECTORY_ENTRIES)  // Number of buckets in the hash index over file names
+// In-memory cached data structures. The tables are allocated by alloc_tables, to the sizes the geometry gives
+
+// The geometry of the file system that is open
+geometry_t geometry = { DEFAULT_BLOCK_SZ, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES };
 
 // The super block
 superblock_t sb;
 
-// The inode table, an array of inode structs
-inode_t inode_table[NUM_INODES];
-
-// The directory table, an array of directory entry structs
-directory_entry_t directory_table[MAX_DIRECTORY_ENTRIES];
-
-// The free bit map; 1 bit per block
-uint8_t free_bit_map[BIT_MAP_SIZE] = { [0 ... BIT_MAP_SIZE-1] = UINT8_MAX };
+// The inode table, an array of NUM_INODES inode structs
+inode_t *inode_table = NULL;
+
+// The directory table, an array of MAX_DIRECTORY_ENTRIES directory entry structs
+directory_entry_t *directory_table = NULL;
+
+// The free bit map; 1 bit per block, in BIT_MAP_SIZE bytes
+uint8_t *free_bit_map = NULL;
+
+// Where get_index starts looking for a free bit: just past the last bit it handed out
+unsigned int next_free_bit_hint = 0;
+
+// The state of each block of the in-memory metadata: BLOCK_CLEAN if it matches its home location on disk,
+// BLOCK_UNLOGGED if it changed since the last journal commit, and BLOCK_LOGGED if its latest contents are
+// in the journal but have not been checkpointed to its home location yet
+uint8_t *dirty_bit_map_blocks = NULL;    // NUM_BIT_MAP_BLOCKS of them
+uint8_t *dirty_inode_blocks = NULL;      // NUM_INODE_BLOCKS of them
+uint8_t *dirty_directory_blocks = NULL;  // ROOT_DIRECTORY_SIZE_IN_BLOCKS of them
+
+// Where the next transaction goes in the journal's log, in blocks after the journal header, and its sequence number
+int journal_tail = 0;
+unsigned int journal_sequence = 1;
+// Number of metadata-changing operations since the last journal commit
+int journal_pending_ops = 0;
+
+// Locks, which let several threads (e.g. FUSE's) use the file system at once. When a thread needs more than one,
+// it takes them in this order: journal_lock, directory_lock, an inode lock, allocator_lock, dirty_lock.
+// journal_lock is held shared by every operation that may change metadata, and exclusively by a journal commit,
+// so a commit only ever sees whole operations
+pthread_rwlock_t journal_lock;
+// Guards directory_table and its hash index, the inode, fd and directory pools, fd_table entries being
+// handed out or released, and next_dir_index
+pthread_mutex_t directory_lock = PTHREAD_MUTEX_INITIALIZER;
+// One per inode: held shared to read the file, and exclusively to write it, change its size or blocks, or move
+// the rwpointer of its fd (sfs_fread, sfs_readv and sfs_fseek do)
+pthread_rwlock_t *inode_locks = NULL;
+// Guards free_bit_map and next_free_bit_hint
+pthread_mutex_t allocator_lock = PTHREAD_MUTEX_INITIALIZER;
+// Guards the dirty_* arrays and journal_pending_ops
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+// Guards the ra_* fields of fd_table entries, readahead_stats and readahead_max_blocks. Taken under an inode lock,
+// after which no other lock is taken, and never held while doing I/O
+pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+int locks_initialized = 0;
 
 // The file descriptor table. Keeps track of the files that are currently open
 // We can have a maximum of NUM_INODES - 1 files open at once, since we have NUM_INODES - 1 inodes available for files
-file_descriptor_t fd_table[FD_TABLE_SIZE];
+file_descriptor_t *fd_table = NULL;
 
 // For use with sfs_getnextfilename
 int next_dir_index = -1;
 
+// Largest readahead window in blocks, 0 to turn readahead off, and what readahead has done so far
+int readahead_max_blocks = READAHEAD_MAX_BLOCKS;
+readahead_stats_t readahead_stats;
+
+// How durable disk writes are made, passed to disk_emu when a file system is made or opened
+int durability_mode = KEITHS_DISK_DURABILITY;
+
+// 1 if new files keep their data in their inode for as long as it fits, see sfs_set_inline_data
+int inline_data_on = 1;
+
+/**
+ * A pool of ids 0 to size - 1, used to hand out inodes, file descriptors and directory slots.
+ * free has one bit per id (1 = free), and summary has one bit per word of free that still has a free id,
+ * so the lowest free id is found by looking at a single summary word rather than scanning every entry
+ */
+typedef struct {
+    int size;
+    uint64_t *free;
+    uint64_t *summary;
+} id_pool_t;
+
+id_pool_t inode_pool;
+id_pool_t fd_pool;
+id_pool_t directory_pool;
+
+// Reverse map from inode number to the fd the file is open under, or -1 if it is not open
+int *fd_for_inode = NULL;
+
+// Hash index over the file names in directory_table. Each of the DIR_HASH_SIZE buckets holds the index of its first
+// directory entry, and dir_hash_next chains the entries of a bucket together. -1 ends a chain
+int *dir_hash_heads = NULL;
+int *dir_hash_next = NULL;
+
 /*******************************************************************
  ****************** A boat-load of helper functions ****************
  *******************************************************************/
 
+/*********************
+ * Free-list helpers
+ *********************/
+
+/**
+ * Marks id as free
+ */
+void release_id(id_pool_t *pool, int id) {
+    pool->free[id / 64] |= (uint64_t) 1 << (id % 64);
+    pool->summary[id / 4096] |= (uint64_t) 1 << (id / 64 % 64);
+}
+
+/**
+ * Marks id as used
+ */
+void take_id(id_pool_t *pool, int id) {
+    pool->free[id / 64] &= ~((uint64_t) 1 << (id % 64));
+    if (pool->free[id / 64] == 0) {
+        pool->summary[id / 4096] &= ~((uint64_t) 1 << (id / 64 % 64));
+    }
+}
+
+/**
+ * Sets up a pool of size ids, all of them free
+ */
+void init_id_pool(id_pool_t *pool, int size) {
+    int num_words = (size + 63) / 64;
+    free(pool->free);
+    free(pool->summary);
+    pool->size = size;
+    pool->free = calloc(num_words, sizeof(uint64_t));
+    pool->summary = calloc((num_words + 63) / 64, sizeof(uint64_t));
+    for (int id = 0; id < size; id++) {
+        release_id(pool, id);
+    }
+}
+
+/**
+ * Takes the lowest free id and returns it, or -1 if every id is used
+ */
+int take_lowest_id(id_pool_t *pool) {
+    int num_summary_words = ((pool->size + 63) / 64 + 63) / 64;
+    for (int s = 0; s < num_summary_words; s++) {
+        if (pool->summary[s] != 0) {
+            int word = s * 64 + __builtin_ctzll(pool->summary[s]);
+            int id = word * 64 + __builtin_ctzll(pool->free[word]);
+            take_id(pool, id);
+            return id;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Rebuilds the inode, fd and directory pools and the inode to fd map from the in-memory tables
+ */
+void rebuild_free_lists() {
+    init_id_pool(&inode_pool, NUM_INODES);
+    for (int i = 0; i < NUM_INODES; i++) {
+        fd_for_inode[i] = -1;
+        if (inode_table[i].is_used) {
+            take_id(&inode_pool, i);
+        }
+    }
+    init_id_pool(&fd_pool, FD_TABLE_SIZE);
+    for (int i = 0; i < FD_TABLE_SIZE; i++) {
+        if (fd_table[i].inode_no != 0) {
+            take_id(&fd_pool, i);
+            fd_for_inode[fd_table[i].inode_no] = i;
+        }
+    }
+    init_id_pool(&directory_pool, MAX_DIRECTORY_ENTRIES);
+    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
+        if (directory_table[i].inode_no != 0) {
+            take_id(&directory_pool, i);
+        }
+    }
+}
+
+/*********************
+ * Indirect block helpers
+ *
+ * Past its NUM_DIRECT_POINTERS direct pointers, a file's blocks are found through up to NUM_INDIRECT_LEVELS trees
+ * of indirect blocks, each of which holds NUM_INDIRECT_POINTERS pointers. The tree of level 1 is the single
+ * indirect block, whose pointers point at data blocks; the tree of level 2 is a block of pointers to single
+ * indirect blocks; and so on. The trees are filled in file order, so a file's last tree is the only partial one.
+ *********************/
+
+/**
+ * Returns the number of data blocks covered by one pointer of an indirect block at height h of a tree, where a
+ * single indirect block (whose pointers point at data blocks) is at height 1. This is NUM_INDIRECT_POINTERS^(h-1),
+ * so get_blocks_per_pointer(level + 1) is the number of data blocks the whole tree of a level covers
+ */
+long long get_blocks_per_pointer(int h) {
+    long long span = 1;
+    for (int i = 1; i < h; i++) {
+        span *= NUM_INDIRECT_POINTERS;
+    }
+    return span;
+}
+
+/**
+ * Returns which of the inode's pointers leads to the nth block of a file: 0 for a direct pointer, or the level of
+ * the tree of indirect blocks it is in. Sets offset to the number of the block within that tree
+ */
+int get_indirection_level(int nth, int *offset) {
+    *offset = nth;
+    if (nth < NUM_DIRECT_POINTERS) {
+        return 0;
+    }
+    *offset -= NUM_DIRECT_POINTERS;
+    int level = 1;
+    while (level < NUM_INDIRECT_LEVELS && *offset >= get_blocks_per_pointer(level + 1)) {
+        *offset -= get_blocks_per_pointer(level + 1);
+        level++;
+    }
+    return level;
+}
+
+/**
+ * Returns the inode's pointer to the root of its tree of indirect blocks of the given level
+ */
+unsigned int *get_indirect_root(int inode_no, int level) {
+    if (level == 1) {
+        return &inode_table[inode_no].indirect_ptr;
+    } else if (level == 2) {
+        return &inode_table[inode_no].double_indirect_ptr;
+    }
+    return &inode_table[inode_no].triple_indirect_ptr;
+}
+
+/**
+ * Reads the first count data block numbers of the tree of indirect blocks rooted at block, at height h, into block_map.
+ * A pointer of 0 is a hole: the tree has no block there. When it is the pointer to an indirect block, every block
+ * under it is a hole
+ */
+void load_pointer_tree(unsigned int block, int h, unsigned int *block_map, int count) {
+    if (block == 0) {
+        memset(block_map, 0, count * sizeof(unsigned int));
+        return;
+    }
+    if (h == 1) {
+        cached_read_bytes(block, 0, count * sizeof(unsigned int), block_map);
+        return;
+    }
+    unsigned int ptrs[NUM_INDIRECT_POINTERS];
+    int span = get_blocks_per_pointer(h);
+    int children = (count + span - 1) / span;
+    cached_read_bytes(block, 0, children * sizeof(unsigned int), ptrs);
+    for (int i = 0; i < children; i++) {
+        int n = (count - i * span < span) ? count - i * span : span;
+        load_pointer_tree(ptrs[i], h - 1, block_map + i * span, n);
+    }
+}
+
+/**
+ * Frees the first count data blocks of the tree of indirect blocks rooted at block, at height h, and the indirect
+ * blocks that lead to them, including block
+ */
+void free_pointer_tree(unsigned int block, int h, int count) {
+    if (block == 0) {
+        return;
+    }
+    unsigned int ptrs[NUM_INDIRECT_POINTERS];
+    int span = get_blocks_per_pointer(h);
+    int children = (count + span - 1) / span;
+    cached_read_bytes(block, 0, children * sizeof(unsigned int), ptrs);
+    for (int i = 0; i < children; i++) {
+        if (h == 1) {
+            if (ptrs[i] != 0) {
+                rm_index(ptrs[i]);
+            }
+        } else {
+            free_pointer_tree(ptrs[i], h - 1, (count - i * span < span) ? count - i * span : span);
+        }
+    }
+    rm_index(block);
+}
+
+/**
+ * Returns the number of indirect blocks the tree of indirect blocks rooted at block, at height h, needs to gain
+ * to have pointers for data blocks first to last (numbered within the tree, of which block covers the ones from
+ * base on). block is 0 if it doesn't exist yet, in which case it and every indirect block under it that covers
+ * part of first..last is needed: at each height g below h, one per NUM_INDIRECT_POINTERS^g data blocks
+ */
+int count_missing_indirect_blocks(unsigned int block, int h, int base, int first, int last) {
+    if (block == 0) {
+        int count = 1;
+        for (int g = 1; g < h; g++) {
+            int covered = get_blocks_per_pointer(g + 1);
+            count += last / covered - first / covered + 1;
+        }
+        return count;
+    }
+    if (h == 1) {
+        return 0;
+    }
+    int span = get_blocks_per_pointer(h);
+    int count = 0;
+    for (int i = (first - base) / span; i <= (last - base) / span; i++) {
+        int child_base = base + i * span;
+        unsigned int child;
+        cached_read_bytes(block, i * sizeof(unsigned int), sizeof(unsigned int), &child);
+        count += count_missing_indirect_blocks(child, h - 1, child_base, (first > child_base) ? first : child_base,
+                                               (last < child_base + span - 1) ? last : child_base + span - 1);
+    }
+    return count;
+}
+
+/**
+ * Points the tree of indirect blocks rooted at block, at height h, at the data blocks tree_map[first] to
+ * tree_map[last] (numbered within the tree, of which block covers the ones from base on). Indirect blocks the tree
+ * is missing are taken in turn from *new_blocks, as counted by count_missing_indirect_blocks. fresh is set if block
+ * was just taken, in which case it is zero-filled rather than read when it is first written
+ */
+void link_pointer_tree(unsigned int block, int fresh, int h, int base, const unsigned int *tree_map, int first, int last,
+                       unsigned int **new_blocks) {
+    if (h == 1) {
+        cached_write_bytes(block, (first - base) * sizeof(unsigned int), (last - first + 1) * sizeof(unsigned int),
+                           tree_map + first, fresh);
+        return;
+    }
+    int span = get_blocks_per_pointer(h);
+    for (int i = (first - base) / span; i <= (last - base) / span; i++) {
+        int child_base = base + i * span;
+        unsigned int child = 0;
+        int child_fresh = 0;
+        if (!fresh) {
+            cached_read_bytes(block, i * sizeof(unsigned int), sizeof(unsigned int), &child);
+        }
+        if (child == 0) {
+            child = *(*new_blocks)++;
+            child_fresh = 1;
+            cached_write_bytes(block, i * sizeof(unsigned int), sizeof(unsigned int), &child, fresh);
+            fresh = 0;
+        }
+        link_pointer_tree(child, child_fresh, h - 1, child_base, tree_map, (first > child_base) ? first : child_base,
+                          (last < child_base + span - 1) ? last : child_base + span - 1, new_blocks);
+    }
+}
+
+/**
+ * Clears the pointers to data blocks first to last (numbered within the tree, of which block covers the ones from
+ * base on) in the tree of indirect blocks rooted at block, at height h, and frees the indirect blocks under block
+ * that are left without any pointers. The data blocks themselves are not freed.
+ * Returns 1 if block is left without any pointers, so the caller can free it too, and 0 otherwise
+ */
+int unlink_pointer_tree(unsigned int block, int h, int base, int first, int last) {
+    unsigned int ptrs[NUM_INDIRECT_POINTERS];
+    int span = get_blocks_per_pointer(h);
+    if (h == 1) {
+        memset(ptrs, 0, sizeof(ptrs));
+        cached_write_bytes(block, (first - base) * sizeof(unsigned int), (last - first + 1) * sizeof(unsigned int), ptrs, 0);
+    } else {
+        for (int i = (first - base) / span; i <= (last - base) / span; i++) {
+            int child_base = base + i * span;
+            unsigned int child;
+            cached_read_bytes(block, i * sizeof(unsigned int), sizeof(unsigned int), &child);
+            if (child != 0 && unlink_pointer_tree(child, h - 1, child_base, (first > child_base) ? first : child_base,
+                                                  (last < child_base + span - 1) ? last : child_base + span - 1)) {
+                rm_index(child);
+                child = 0;
+                cached_write_bytes(block, i * sizeof(unsigned int), sizeof(unsigned int), &child, 0);
+            }
+        }
+    }
+    cached_read_bytes(block, 0, sizeof(ptrs), ptrs);
+    for (int i = 0; i < NUM_INDIRECT_POINTERS; i++) {
+        if (ptrs[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /*********************
  * Getter helpers
  *********************/
@@ -54,30 +412,25 @@ int get_next_filled_directory_entry_starting_at(int index) {
 }
 
 /**
- * Takes a file name and returns the index of the directory table entry for the file,
- * or -1 if the file was not found
+ * Returns the bucket of the directory hash index that the given file name falls in (FNV-1a)
  */
-int get_directory_index_for_file_with_name(char *file_name) {
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
-        // Check if the directory table entry is used. If so, check the file name, else continue
-        // If we don't perform this check, and the file_name pointer is null, then we get a seg fault
-        if (directory_table[i].inode_no != 0) {
-            if (strcmp(directory_table[i].file_name, file_name) == 0) {
-                printf("Found directory match at index %d\n", i);
-                return i;
-            }
-        }
+unsigned int hash_file_name(const char *file_name) {
+    unsigned int hash = 2166136261u;
+    for (; *file_name != '\0'; file_name++) {
+        hash = (hash ^ (unsigned char) *file_name) * 16777619u;
     }
-    return -1;
+    return hash % DIR_HASH_SIZE;
 }
 
 /**
- * Iterates through the file descriptor table in search of the given inode number. Returns the index
- * containing the inode number or -1 if the inode number is not in the table
+ * Takes a file name and returns the index of the directory table entry for the file,
+ * or -1 if the file was not found
+ * Only the entries that hash to the same bucket as file_name are compared
  */
-int get_fd_for_file_with_inode(int inode_no) {
-    for (int i = 0; i < NUM_INODES; i++) {
-        if (fd_table[i].inode_no == inode_no) {
+int get_directory_index_for_file_with_name(const char *file_name) {
+    for (int i = dir_hash_heads[hash_file_name(file_name)]; i != -1; i = dir_hash_next[i]) {
+        if (strcmp(directory_table[i].file_name, file_name) == 0) {
+            printf("Found directory match at index %d\n", i);
             return i;
         }
     }
@@ -85,43 +438,33 @@ int get_fd_for_file_with_inode(int inode_no) {
 }
 
 /**
- * Returns the next available file descriptor by iterating through the fd_table
- * and returning the first index with inode_no = 0 (this indicates an unused entry)
- * Returns -1 if no available file descriptors left
+ * Returns the fd the file with the given inode number is open under, or -1 if the file is not open
  */
-int get_next_available_fd() {
-    for (int i = 0; i < FD_TABLE_SIZE; i++) {
-        if (fd_table[i].inode_no == 0) {
-            return i;
-        }
-    }
-    return -1;
+int get_fd_for_file_with_inode(int inode_no) {
+    return fd_for_inode[inode_no];
 }
 
 /**
- * Returns the number corresponding to earliest free inode in the inode table,
+ * Takes the earliest free inode in the inode table and returns its number,
  * or -1 if all inodes are used
  */
 int get_next_available_inode() {
-    for (int i = 0; i < NUM_INODES; i++) {
-        if (!inode_table[i].is_used) {
-            return i;
-        }
-    }
-    return -1;
+    return take_lowest_id(&inode_pool);
 }
 
 /**
- * Iterates through the directory and returns the index of the first available entry (where inode_no == 0),
+ * Takes the first available entry of the directory (where inode_no == 0) and returns its index,
  * or -1 if no available entries
  */
 int get_next_available_directory_entry() {
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
-        if (directory_table[i].inode_no == 0) {
-            return i;
-        }
-    }
-    return -1;
+    return take_lowest_id(&directory_pool);
+}
+
+/**
+ * Takes a file size in bytes and returns the number of blocks a file of that size has allocated to it
+ */
+int get_number_of_blocks_for_size(int64_t size) {
+    return (size + BLOCK_SZ - 1) / BLOCK_SZ;
 }
 
 /**
@@ -136,7 +479,7 @@ int get_block_number_corresponding_to_nth_block_for_file(int inode_no, int nth)
         printf("Error: There are no negative sequential block numbers.\n");
         return -1;
     }
-    if (nth > (inode.size / BLOCK_SZ)) {
+    if (nth >= get_number_of_blocks_for_size(inode.size)) {
         printf("Error: Attempting to access a block the file does not have.\n");
         return -1;
     }
@@ -146,15 +489,152 @@ int get_block_number_corresponding_to_nth_block_for_file(int inode_no, int nth)
         printf("Getting direct pointer\n");
         return inode.data_ptrs[nth];
     } else {
-        // We need to read the block of number inode.indirect_ptr into memory
+        // Walk down from the root of the tree of indirect blocks the block is in, reading one pointer per level
         printf("Getting indirect pointer\n");
-        char ind_ptrs[BLOCK_SZ];
-        read_blocks(inode.indirect_ptr, 1, ind_ptrs);
-        int indirect_ptrs[NUM_INDIRECT_POINTERS];
-        memcpy(indirect_ptrs, ind_ptrs, sizeof(indirect_ptrs));
-        // Now, we need to return the (nth - NUM_DIRECT_POINTERS)th pointer in the indirect_ptrs array
-        return indirect_ptrs[nth - NUM_DIRECT_POINTERS];
+        int offset;
+        int level = get_indirection_level(nth, &offset);
+        unsigned int block = *get_indirect_root(inode_no, level);
+        for (int h = level; h >= 1 && block != 0; h--) {
+            int span = get_blocks_per_pointer(h);
+            cached_read_bytes(block, (offset / span) * sizeof(unsigned int), sizeof(unsigned int), &block);
+            offset %= span;
+        }
+        return block;
+    }
+}
+
+/**
+ * Resolves every block of the file with inode inode_no into block_map, which has room for all of them, in file order.
+ * Each indirect block is read once.
+ * Returns the number of blocks the file has, which is 0 for a file whose data is in its inode
+ */
+int load_block_map(int inode_no, unsigned int *block_map) {
+    if (inode_table[inode_no].flags & INODE_INLINE) {
+        return 0;
+    }
+    int num_blocks = get_number_of_blocks_for_size(inode_table[inode_no].size);
+    for (int i = 0; i < num_blocks && i < NUM_DIRECT_POINTERS; i++) {
+        block_map[i] = inode_table[inode_no].data_ptrs[i];
+    }
+    long long base = NUM_DIRECT_POINTERS;
+    for (int level = 1; level <= NUM_INDIRECT_LEVELS && base < num_blocks; level++) {
+        long long span = get_blocks_per_pointer(level + 1);
+        int count = (num_blocks - base < span) ? num_blocks - base : span;
+        load_pointer_tree(*get_indirect_root(inode_no, level), level, block_map + base, count);
+        base += span;
+    }
+    return num_blocks;
+}
+
+/**
+ * Returns the extent (run of blocks contiguous on disk) that starts at block first of a file's block map,
+ * going no further than block last. An extent can be read or written with a single call.
+ * An extent whose start is 0 is a hole: a run of blocks the file doesn't have, which read as zeros
+ */
+extent_t get_extent_at(unsigned int *block_map, int first, int last) {
+    extent_t extent = { block_map[first], 1 };
+    while (first + (int) extent.length <= last
+           && block_map[first + extent.length] == ((extent.start == 0) ? 0 : extent.start + extent.length)) {
+        extent.length++;
+    }
+    return extent;
+}
+
+/**
+ * Reads blocks first through last (inclusive) of a file from the block cache straight into buf, which holds
+ * (last - first + 1) * BLOCK_SZ bytes. Holes are zero-filled without any I/O, and the rest are read with one call,
+ * so the blocks that aren't cached are all requested from disk at once however the file is laid out
+ */
+void read_whole_blocks(unsigned int *block_map, int first, int last, char *buf) {
+    for (int i = first; i <= last; i++) {
+        if (block_map[i] == 0) {
+            memset(buf + (size_t) (i - first) * BLOCK_SZ, 0, BLOCK_SZ);
+        }
+    }
+    cached_read_list(block_map + first, last - first + 1, buf);
+}
+
+/**
+ * Copies len bytes starting at byte offset of the file block stored in block block_no into buf. Block 0 (the
+ * superblock) is never a file's, and stands for a hole, which reads as zeros
+ */
+void read_block_bytes(unsigned int block_no, int offset, int len, char *buf) {
+    if (block_no == 0) {
+        memset(buf, 0, len);
+    } else {
+        cached_read_bytes(block_no, offset, len, buf);
+    }
+}
+
+/**
+ * Writes blocks first through last (inclusive) of a file into the block cache straight from buf, which holds
+ * (last - first + 1) * BLOCK_SZ bytes, with one call per extent
+ */
+void write_whole_blocks(unsigned int *block_map, int first, int last, const char *buf) {
+    while (first <= last) {
+        extent_t extent = get_extent_at(block_map, first, last);
+        printf("Writing blocks %d to %d for file back to disk\n", extent.start, extent.start + extent.length - 1);
+        cached_write_blocks(extent.start, extent.length, buf);
+        buf += extent.length * BLOCK_SZ;
+        first += extent.length;
+    }
+}
+
+/**
+ * Returns the size of the open file at index fd of the fd table, counting appends still in its append buffer
+ */
+int64_t get_size_of_open_file(int fd) {
+    return inode_table[fd_table[fd].inode_no].size + fd_table[fd].append_len;
+}
+
+/**
+ * Returns 1 if fileID is the number of an open file, and 0 (after saying so) otherwise
+ */
+int is_open_fd(int fileID) {
+    if (fileID < 0 || fileID >= FD_TABLE_SIZE || fd_table[fileID].inode_no == 0) {
+        printf("Error: The file is not open.\n");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Makes sure the block map of the open file at index fd of the fd table has room for num_blocks entries
+ * Returns 0 on success and -1 if memory could not be allocated
+ */
+int grow_block_map(int fd, int num_blocks) {
+    if (num_blocks <= fd_table[fd].map_cap) {
+        return 0;
+    }
+    // Grow by at least half again, so that a file growing a block at a time isn't copied every time
+    int cap = fd_table[fd].map_cap + fd_table[fd].map_cap / 2;
+    if (cap < num_blocks) {
+        cap = num_blocks;
+    }
+    unsigned int *block_map = realloc(fd_table[fd].block_map, cap * sizeof(unsigned int));
+    if (block_map == NULL) {
+        printf("Error: Could not allocate a block map of %d blocks.\n", cap);
+        return -1;
+    }
+    fd_table[fd].block_map = block_map;
+    fd_table[fd].map_cap = cap;
+    return 0;
+}
+
+/**
+ * Returns the block map of the open file at index fd of the fd table, resolving it first if need be,
+ * or NULL if memory for it could not be allocated
+ */
+unsigned int* get_block_map_for_fd(int fd) {
+    if (!fd_table[fd].map_valid) {
+        int num_blocks = get_number_of_blocks_for_size(inode_table[fd_table[fd].inode_no].size);
+        if (grow_block_map(fd, (num_blocks > 0) ? num_blocks : 1) == -1) {
+            return NULL;
+        }
+        fd_table[fd].map_len = load_block_map(fd_table[fd].inode_no, fd_table[fd].block_map);
+        fd_table[fd].map_valid = 1;
     }
+    return fd_table[fd].block_map;
 }
 
 /**
@@ -162,7 +642,7 @@ int get_block_number_corresponding_to_nth_block_for_file(int inode_no, int nth)
  * inode_no = the inode corresponding to the file or directory
  * byte_no = the number of a byte that resides in the block we want to find
  */
-int get_block_number_containing_byte_for_inode(int inode_no, int byte_no) {
+int get_block_number_containing_byte_for_inode(int inode_no, int64_t byte_no) {
     inode_t inode = inode_table[inode_no];
     // Error checking
     if (byte_no < 0) {
@@ -185,52 +665,221 @@ int get_block_number_containing_byte_for_inode(int inode_no, int byte_no) {
  * Takes the number of a byte in a file (could be any file), and determines whether this byte
  * is in the 0th, 1st, 2nd, 3rd, ..., nth block of the file and returns this number
  */
-int get_sequential_block_number_containing_byte(int byte_no) {
+int get_sequential_block_number_containing_byte(int64_t byte_no) {
     return byte_no / BLOCK_SZ;
 }
 
 /*********************
- * Flush helpers
+ * Readahead helpers
  *********************/
 
- /**
-  * Flush superblock
-  */
- void flush_superblock() {
-     write_blocks(0, 1, &sb);
- }
+/**
+ * Called by read_file before it reads blocks first_block through last_block of the open file fileID.
+ * A read that starts in or right after the block the previous read ended in is sequential. A file read
+ * sequentially gets the READAHEAD_MIN_BLOCKS blocks past the read prefetched into the block cache with it, and
+ * each time a read gets to the second half of what is prefetched, the window doubles (up to readahead_max_blocks)
+ * and the next window is prefetched. Any other read turns readahead off for the file until it is read
+ * sequentially again. Blocks the read needs that weren't prefetched yet are fetched together with the window,
+ * so a long sequential read makes one read_blocks call per window (per extent, if the file is fragmented)
+ * rather than one per read.
+ * The caller must hold the file's inode lock, shared or exclusive
+ */
+void do_readahead(int fileID, int first_block, int last_block) {
+    file_descriptor_t *f = &fd_table[fileID];
+    int from = 0;
+    int to = -1;
+
+    pthread_mutex_lock(&readahead_lock);
+    int sequential = (first_block == f->ra_last_block || first_block == f->ra_last_block + 1);
+    if (!sequential || readahead_max_blocks == 0) {
+        f->ra_window = 0;
+        f->ra_end = 0;
+    } else {
+        // Count the blocks this read is the first to reach that were prefetched
+        int first_new = (first_block > f->ra_last_block) ? first_block : f->ra_last_block + 1;
+        int last_hit = (last_block < f->ra_end - 1) ? last_block : f->ra_end - 1;
+        if (last_hit >= first_new) {
+            readahead_stats.blocks_hit += last_hit - first_new + 1;
+        }
+        int trigger = 0;
+        if (f->ra_window == 0) {
+            f->ra_window = READAHEAD_MIN_BLOCKS;
+            trigger = 1;
+        } else if (last_block + f->ra_window / 2 >= f->ra_end) {
+            f->ra_window *= 2;
+            trigger = 1;
+        }
+        if (f->ra_window > readahead_max_blocks) {
+            f->ra_window = readahead_max_blocks;
+        }
+        if (trigger) {
+            from = (f->ra_end > first_block) ? f->ra_end : first_block;
+            to = last_block + f->ra_window;
+            if (to > f->map_len - 1) {
+                to = f->map_len - 1;
+            }
+            if (to > last_block) {
+                readahead_stats.windows++;
+                readahead_stats.blocks_prefetched += to - ((from > last_block) ? from : last_block + 1) + 1;
+                readahead_stats.window = f->ra_window;
+                if (f->ra_window > readahead_stats.max_window) {
+                    readahead_stats.max_window = f->ra_window;
+                }
+            }
+            if (to >= from) {
+                f->ra_end = to + 1;
+            }
+        }
+    }
+    f->ra_last_block = last_block;
+    pthread_mutex_unlock(&readahead_lock);
 
-  /**
-   * Flush free bit map
-   */
- void flush_free_bit_map() {
-     write_blocks(1, NUM_BIT_MAP_BLOCKS, free_bit_map);
- }
+    while (from <= to) {
+        extent_t extent = get_extent_at(f->block_map, from, to);
+        if (extent.start != 0) {
+            cached_prefetch_blocks(extent.start, extent.length);
+        }
+        from += extent.length;
+    }
+}
 
- /**
-  * Flush inode table
-  */
- void flush_inode_table() {
-     write_blocks(1 + NUM_BIT_MAP_BLOCKS, sb.inode_table_len, inode_table);
- }
+/**
+ * Sets the largest readahead window, in blocks. 0 turns readahead off
+ */
+void sfs_set_readahead(int max_blocks) {
+    pthread_mutex_lock(&readahead_lock);
+    readahead_max_blocks = (max_blocks < 0) ? 0 : max_blocks;
+    pthread_mutex_unlock(&readahead_lock);
+}
 
- /**
-  * Copies the directory_table into a character array and returns a pointer to the start of it
-  */
- /*char* convert_directory_table_to_char_array() {
-     char dir_tbl_as_char_array[sizeof(directory_table)];
-     memcpy(dir_tbl_as_char_array, directory_table, sizeof(directory_table));
-     return dir_tbl_as_char_array;
- }*/
+/**
+ * Returns what readahead has done since the file system was made or opened. blocks_hit / blocks_prefetched
+ * is the fraction of prefetched blocks that were used
+ */
+readahead_stats_t sfs_get_readahead_stats() {
+    pthread_mutex_lock(&readahead_lock);
+    readahead_stats_t stats = readahead_stats;
+    pthread_mutex_unlock(&readahead_lock);
+    return stats;
+}
 
- /**
-  * Flush root directory
-  */
-void flush_root_directory() {
-    // We need to flush the entire root directory to disk. This means we have to get the blocks pointed to
-    // by the root directory's inode one by one, and incrementally write the directory_table to these blocks
-    //char* buf = convert_directory_table_to_char_array();
-    // Cast directory_table to a char pointer so we can increment it by bytes rather than sizeof(directory_entry_t)
+/*********************
+ * Directory index helpers
+ *********************/
+
+/**
+ * Adds the directory entry at the given index to the hash index, under its file name
+ */
+void add_to_directory_index(int index) {
+    unsigned int bucket = hash_file_name(directory_table[index].file_name);
+    dir_hash_next[index] = dir_hash_heads[bucket];
+    dir_hash_heads[bucket] = index;
+}
+
+/**
+ * Removes the directory entry at the given index from the hash index. Must be called before the entry's name changes
+ */
+void remove_from_directory_index(int index) {
+    int *p = &dir_hash_heads[hash_file_name(directory_table[index].file_name)];
+    while (*p != -1 && *p != index) {
+        p = &dir_hash_next[*p];
+    }
+    if (*p == index) {
+        *p = dir_hash_next[index];
+    }
+}
+
+/**
+ * Rebuilds the hash index from scratch out of the occupied entries of directory_table
+ */
+void rebuild_directory_index() {
+    for (int i = 0; i < DIR_HASH_SIZE; i++) {
+        dir_hash_heads[i] = -1;
+    }
+    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
+        if (directory_table[i].inode_no != 0) {
+            add_to_directory_index(i);
+        }
+    }
+}
+
+/*********************
+ * Flush helpers
+ *********************/
+
+/**
+ * Copies block nth of an in-memory table of table_size bytes to dest, which must hold BLOCK_SZ bytes.
+ * The last block of the table is padded with zeros rather than read past the end of the table
+ */
+void copy_table_block(char *dest, const void *table, size_t table_size, int nth) {
+    size_t offset = (size_t) nth * BLOCK_SZ;
+    size_t len = (table_size - offset < BLOCK_SZ) ? table_size - offset : BLOCK_SZ;
+    memset(dest + len, 0, BLOCK_SZ - len);
+    memcpy(dest, (const char *) table + offset, len);
+}
+
+/**
+ * Writes the first nblocks blocks of an in-memory table of table_size bytes to disk, starting at block first_block
+ */
+void write_table(int first_block, const void *table, size_t table_size, int nblocks) {
+    char *blocks = malloc((size_t) nblocks * BLOCK_SZ);
+    for (int i = 0; i < nblocks; i++) {
+        copy_table_block(blocks + (size_t) i * BLOCK_SZ, table, table_size, i);
+    }
+    cached_write_blocks(first_block, nblocks, blocks);
+    free(blocks);
+}
+
+/**
+ * Writes 0's over nblocks blocks starting at first_block, for metadata that has to start out empty.
+ * They go straight to disk rather than through the block cache, as the journal they are used for is written that way
+ */
+void zero_blocks(int first_block, int nblocks) {
+    char *blocks = calloc(nblocks, BLOCK_SZ);
+    write_blocks(first_block, nblocks, blocks);
+    free(blocks);
+}
+
+ /**
+  * Flush superblock
+  */
+ void flush_superblock() {
+     write_table(0, &sb, sizeof(sb), 1);
+ }
+
+  /**
+   * Flush free bit map
+   */
+ void flush_free_bit_map() {
+     write_table(1, free_bit_map, BIT_MAP_SIZE, NUM_BIT_MAP_BLOCKS);
+     memset(dirty_bit_map_blocks, 0, NUM_BIT_MAP_BLOCKS);
+ }
+
+ /**
+  * Flush inode table
+  */
+ void flush_inode_table() {
+     write_table(1 + NUM_BIT_MAP_BLOCKS, inode_table, INODE_TABLE_SIZE_IN_BYTES, sb.inode_table_len);
+     memset(dirty_inode_blocks, 0, NUM_INODE_BLOCKS);
+ }
+
+ /**
+  * Copies the directory_table into a character array and returns a pointer to the start of it
+  */
+ /*char* convert_directory_table_to_char_array() {
+     char dir_tbl_as_char_array[ROOT_DIRECTORY_SIZE_IN_BYTES];
+     memcpy(dir_tbl_as_char_array, directory_table, ROOT_DIRECTORY_SIZE_IN_BYTES);
+     return dir_tbl_as_char_array;
+ }*/
+
+ /**
+  * Flush root directory
+  */
+void flush_root_directory() {
+    // We need to flush the entire root directory to disk. This means we have to get the blocks pointed to
+    // by the root directory's inode one by one, and incrementally write the directory_table to these blocks
+    //char* buf = convert_directory_table_to_char_array();
+    // Cast directory_table to a char pointer so we can increment it by bytes rather than sizeof(directory_entry_t)
     char* p = (char *) directory_table;
     printf("FLUSHING THE ROOT DIRECTORY\n");
     printf("The root directory size in bytes is: %d\n", ROOT_DIRECTORY_SIZE_IN_BYTES);
@@ -241,12 +890,100 @@ void flush_root_directory() {
        if (block_no !=  -1) {
            printf("Writing block %d of root directory\n", i);
            printf("Write of 1 block starting at byte %d\n", j);
-           write_blocks(block_no, 1, p + j);
+           char block[BLOCK_SZ];
+           copy_table_block(block, p, ROOT_DIRECTORY_SIZE_IN_BYTES, i);
+           cached_write_blocks(block_no, 1, block);
        } else {
            printf("Error: Attempted to access memory outside of the scope of the directory table - root directory flush failed.\n");
            break;
        }
     }
+    memset(dirty_directory_blocks, 0, ROOT_DIRECTORY_SIZE_IN_BLOCKS);
+}
+
+/**
+ * Marks the blocks of a table that hold bytes first_byte to first_byte + len - 1 as changed and not yet journaled
+ */
+void mark_dirty(uint8_t *dirty_blocks, size_t first_byte, size_t len) {
+    pthread_mutex_lock(&dirty_lock);
+    for (size_t b = first_byte / BLOCK_SZ; b <= (first_byte + len - 1) / BLOCK_SZ; b++) {
+        dirty_blocks[b] = BLOCK_UNLOGGED;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+void mark_inode_dirty(int inode_no) {
+    mark_dirty(dirty_inode_blocks, inode_no * sizeof(inode_t), sizeof(inode_t));
+}
+
+void mark_bit_map_dirty(unsigned int index) {
+    mark_dirty(dirty_bit_map_blocks, index / 8, 1);
+}
+
+void mark_directory_entry_dirty(int index) {
+    mark_dirty(dirty_directory_blocks, index * sizeof(directory_entry_t), sizeof(directory_entry_t));
+}
+
+/**
+ * Finds the blocks of the free bit map, the inode table and the directory table whose dirty state is state,
+ * and moves them to new_state. If home_blocks is not NULL, the disk block each one lives at is stored in it,
+ * and its current contents are copied to images, one block each.
+ * Returns the number of blocks found
+ */
+int get_metadata_blocks_in_state(uint8_t state, uint8_t new_state, unsigned int *home_blocks, char *images) {
+    int n = 0;
+    for (int i = 0; i < NUM_BIT_MAP_BLOCKS; i++) {
+        if (dirty_bit_map_blocks[i] == state) {
+            if (home_blocks != NULL) {
+                home_blocks[n] = 1 + i;
+                copy_table_block(images + n * BLOCK_SZ, free_bit_map, BIT_MAP_SIZE, i);
+            }
+            dirty_bit_map_blocks[i] = new_state;
+            n++;
+        }
+    }
+    for (int i = 0; i < NUM_INODE_BLOCKS; i++) {
+        if (dirty_inode_blocks[i] == state) {
+            if (home_blocks != NULL) {
+                home_blocks[n] = 1 + NUM_BIT_MAP_BLOCKS + i;
+                copy_table_block(images + n * BLOCK_SZ, inode_table, INODE_TABLE_SIZE_IN_BYTES, i);
+            }
+            dirty_inode_blocks[i] = new_state;
+            n++;
+        }
+    }
+    for (int i = 0; i < ROOT_DIRECTORY_SIZE_IN_BLOCKS; i++) {
+        if (dirty_directory_blocks[i] == state) {
+            int block_no = get_block_number_corresponding_to_nth_block_for_file(0, i);
+            if (block_no == -1) {
+                printf("Error: Root directory has no block %d - directory flush failed.\n", i);
+                break;
+            }
+            if (home_blocks != NULL) {
+                home_blocks[n] = block_no;
+                copy_table_block(images + n * BLOCK_SZ, directory_table, ROOT_DIRECTORY_SIZE_IN_BYTES, i);
+            }
+            dirty_directory_blocks[i] = new_state;
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * Writes the metadata blocks whose dirty state is state to their home locations on disk (through the block cache),
+ * and marks them clean
+ */
+void write_metadata_blocks_home(uint8_t state) {
+    int count = get_metadata_blocks_in_state(state, state, NULL, NULL);
+    unsigned int *home_blocks = malloc((count + 1) * sizeof(unsigned int));
+    char *images = malloc((size_t) (count + 1) * BLOCK_SZ);
+    int n = get_metadata_blocks_in_state(state, BLOCK_CLEAN, home_blocks, images);
+    for (int i = 0; i < n; i++) {
+        cached_write_blocks(home_blocks[i], 1, images + i * BLOCK_SZ);
+    }
+    free(home_blocks);
+    free(images);
 }
 
 /**
@@ -259,18 +996,228 @@ void flush_all() {
     flush_root_directory();
 }
 
+/*********************
+ * Journal helpers
+ *********************/
+
+/**
+ * FNV-1a over len bytes, used to tell a fully written journal transaction from a torn one
+ */
+unsigned int checksum_bytes(const char *data, size_t len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Writes the journal header, saying the log starts afresh at transaction sequence
+ */
+void write_journal_header(unsigned int sequence) {
+    char block[BLOCK_SZ];
+    memset(block, 0, BLOCK_SZ);
+    journal_header_t *header = (journal_header_t *) block;
+    header->magic = JOURNAL_HEADER_MAGIC;
+    header->sequence = sequence;
+    write_blocks(sb.journal_start, 1, block);
+    sync_disk();
+}
+
+/**
+ * Writes the block images of the committed transactions in the log to their home locations (through the block
+ * cache), oldest first, so each block ends up with its last committed image. Starts at the beginning of the log
+ * with the sequence number in the journal header, and stops at the first transaction that is missing, stale or torn.
+ * Leaves journal_tail and journal_sequence just past the last transaction written home
+ * Returns the number of transactions written home, or -1 if the journal header is missing
+ */
+int write_log_home() {
+    journal_tail = 0;
+    char block[BLOCK_SZ];
+    read_blocks(sb.journal_start, 1, block);
+    journal_header_t *header = (journal_header_t *) block;
+    if (header->magic != JOURNAL_HEADER_MAGIC) {
+        printf("Error: The journal header is missing - not replaying the journal\n");
+        return -1;
+    }
+    journal_sequence = header->sequence;
+
+    int replayed = 0;
+    char *txn = malloc((JOURNAL_MAX_TRANSACTION_BLOCKS + 2) * BLOCK_SZ);
+    journal_descriptor_t *descriptor = (journal_descriptor_t *) txn;
+    while (journal_tail + 2 <= (int) sb.journal_len - 1) {
+        read_blocks(sb.journal_start + 1 + journal_tail, 1, txn);
+        int n = descriptor->count;
+        if (descriptor->magic != JOURNAL_DESCRIPTOR_MAGIC || descriptor->sequence != journal_sequence
+            || n > JOURNAL_MAX_TRANSACTION_BLOCKS || journal_tail + n + 2 > (int) sb.journal_len - 1) {
+            break;
+        }
+        read_blocks(sb.journal_start + 2 + journal_tail, n + 1, txn + BLOCK_SZ);
+        journal_commit_t *commit = (journal_commit_t *) (txn + (n + 1) * BLOCK_SZ);
+        if (commit->magic != JOURNAL_COMMIT_MAGIC || commit->sequence != journal_sequence
+            || commit->checksum != checksum_bytes(txn, (n + 1) * BLOCK_SZ)) {
+            break;
+        }
+        printf("Replaying journal transaction %u of %d blocks\n", journal_sequence, n);
+        for (int i = 0; i < n; i++) {
+            cached_write_blocks(descriptor->home_blocks[i], 1, txn + (i + 1) * BLOCK_SZ);
+        }
+        journal_tail += n + 2;
+        journal_sequence++;
+        replayed++;
+    }
+    free(txn);
+    return replayed;
+}
+
+/**
+ * Writes every block logged since the last checkpoint to its home location and makes it durable, after which
+ * the log is no longer needed and starts again from its beginning.
+ * A logged block may have been changed again since its commit, and its changes aren't committed yet, so blocks are
+ * written home from their last committed images in the log rather than from the in-memory metadata
+ */
+void checkpoint_journal() {
+    printf("Checkpointing the journal\n");
+    int tail = journal_tail;
+    unsigned int sequence = journal_sequence;
+    write_log_home();
+    journal_tail = tail;
+    journal_sequence = sequence;
+    // Blocks that weren't changed again since their commit are clean now; the others still wait for a commit
+    get_metadata_blocks_in_state(BLOCK_LOGGED, BLOCK_CLEAN, NULL, NULL);
+    flush_block_cache();
+    sync_disk();
+    write_journal_header(journal_sequence);
+    journal_tail = 0;
+}
+
+/**
+ * Commits the metadata changes made since the last commit as one transaction: a descriptor block listing
+ * the home locations of the changed blocks, their images, and a commit block, appended to the log with a
+ * single write. File data (and blocks of indirect pointers) are flushed first, so a committed inode never
+ * points at blocks whose contents did not make it to disk.
+ * The blocks are not written to their home locations until the journal is checkpointed, which happens
+ * when the log has no room left for the transaction.
+ * Returns 0 on success and -1 if error
+ */
+int commit_journal() {
+    pthread_rwlock_wrlock(&journal_lock);
+    journal_pending_ops = 0;
+    int n = get_metadata_blocks_in_state(BLOCK_UNLOGGED, BLOCK_UNLOGGED, NULL, NULL);
+    if (n == 0) {
+        pthread_rwlock_unlock(&journal_lock);
+        return 0;
+    }
+    if (n + 2 > sb.journal_len - 1 || n > JOURNAL_MAX_TRANSACTION_BLOCKS) {
+        // Too many blocks changed for one transaction, which only happens on a disk whose free bit map or
+        // inode table is large: empty the journal, and write the changes in place
+        checkpoint_journal();
+        write_metadata_blocks_home(BLOCK_UNLOGGED);
+        flush_block_cache();
+        int result = sync_disk();
+        pthread_rwlock_unlock(&journal_lock);
+        return result;
+    }
+    if (journal_tail + n + 2 > sb.journal_len - 1) {
+        checkpoint_journal();
+    }
+
+    char *txn = calloc(n + 2, BLOCK_SZ);
+    journal_descriptor_t *descriptor = (journal_descriptor_t *) txn;
+    journal_commit_t *commit = (journal_commit_t *) (txn + (n + 1) * BLOCK_SZ);
+    descriptor->magic = JOURNAL_DESCRIPTOR_MAGIC;
+    descriptor->sequence = journal_sequence;
+    descriptor->count = get_metadata_blocks_in_state(BLOCK_UNLOGGED, BLOCK_LOGGED, descriptor->home_blocks, txn + BLOCK_SZ);
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->sequence = journal_sequence;
+    commit->checksum = checksum_bytes(txn, (n + 1) * BLOCK_SZ);
+
+    flush_block_cache();
+    printf("Committing journal transaction %u of %d blocks\n", journal_sequence, n);
+    int result = write_blocks(sb.journal_start + 1 + journal_tail, n + 2, txn);
+    free(txn);
+    if (result < 0 || sync_disk() == -1) {
+        printf("Error: Could not write journal transaction %u\n", journal_sequence);
+        // The blocks aren't in the log, so they are committed again next time rather than thought checkpointed
+        get_metadata_blocks_in_state(BLOCK_LOGGED, BLOCK_UNLOGGED, NULL, NULL);
+        pthread_rwlock_unlock(&journal_lock);
+        return -1;
+    }
+    journal_tail += n + 2;
+    journal_sequence++;
+    pthread_rwlock_unlock(&journal_lock);
+    return 0;
+}
+
+/**
+ * Starts an operation that may change metadata. No journal commit can start until the matching journal_end
+ */
+void journal_begin() {
+    pthread_rwlock_rdlock(&journal_lock);
+}
+
+/**
+ * Called once by each operation that changed metadata, after all of its changes (and its file data) are
+ * in memory, and before its journal_end
+ */
+void journal_metadata_changes() {
+    pthread_mutex_lock(&dirty_lock);
+    journal_pending_ops++;
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+/**
+ * Ends an operation started with journal_begin. Changes are committed in groups of JOURNAL_GROUP_OPS
+ * operations, or sooner by sfs_sync. Must be called with no other lock held, as it may commit
+ */
+void journal_end() {
+    pthread_mutex_lock(&dirty_lock);
+    int group_full = journal_pending_ops >= JOURNAL_GROUP_OPS;
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_rwlock_unlock(&journal_lock);
+    if (group_full) {
+        commit_journal();
+    }
+}
+
+/**
+ * Redoes the committed transactions found in the journal, oldest first, stopping at the first one that is
+ * missing, stale or torn, and then checkpoints them. Must run before the metadata is read from disk
+ */
+void replay_journal() {
+    journal_pending_ops = 0;
+    journal_sequence = 1;
+    if (write_log_home() > 0) {
+        checkpoint_journal();
+    }
+    journal_tail = 0;
+}
+
 /*********************
  * Update helpers
  *********************/
 
 /**
  * Adds a file to the fd table. Returns the fd for the file if successful and -1 if error
+ * The caller must hold directory_lock
  */
-int add_to_fd_table(int inode_no, int rwptr) {
-    int fd = get_next_available_fd();
+int add_to_fd_table(int inode_no, int64_t rwptr) {
+    int fd = take_lowest_id(&fd_pool);
     if (fd != -1) {
         fd_table[fd].inode_no = inode_no;
         fd_table[fd].rwptr = rwptr;
+        fd_table[fd].ra_last_block = -1;
+        fd_table[fd].ra_window = 0;
+        fd_table[fd].ra_end = 0;
+        fd_for_inode[inode_no] = fd;
+        // Resolve the block map now, so that readers of the open file, who share the inode lock, never have to
+        if (get_block_map_for_fd(fd) == NULL) {
+            fd_for_inode[inode_no] = -1;
+            fd_table[fd].inode_no = 0;
+            release_id(&fd_pool, fd);
+            return -1;
+        }
         return fd;
     } else {
         printf("Error: You cannot open any more files! No more file descriptors are available.\n");
@@ -278,10 +1225,29 @@ int add_to_fd_table(int inode_no, int rwptr) {
     }
 }
 
+/**
+ * Closes the file at index fd of the fd table, freeing its block map and append buffer, whose appends must have
+ * been written out already
+ * The caller must hold directory_lock, and the file's inode lock exclusively if the fd was handed out
+ */
+void remove_from_fd_table(int fd) {
+    fd_for_inode[fd_table[fd].inode_no] = -1;
+    release_id(&fd_pool, fd);
+    fd_table[fd].inode_no = 0;
+    fd_table[fd].rwptr = 0;
+    fd_table[fd].map_valid = 0;
+    free(fd_table[fd].block_map);
+    fd_table[fd].block_map = NULL;
+    fd_table[fd].map_cap = 0;
+    free(fd_table[fd].append_buf);
+    fd_table[fd].append_buf = NULL;
+    fd_table[fd].append_len = 0;
+}
+
 /**
  * Adds the file name and inode number to the root directory, and returns the index of the root directory
  * at which the entry was inserted, or -1 if no available entries remaining
- * Also, flushes the root directory to disk
+ * The change reaches the disk with the caller's next journal commit
  */
 int add_to_root_directory(int inode_no, char* file_name) {
     int insert_index = get_next_available_directory_entry();
@@ -291,7 +1257,8 @@ int add_to_root_directory(int inode_no, char* file_name) {
         printf("Set the directory entry inode number\n");
         strcpy(directory_table[insert_index].file_name, file_name);
         printf("Set the directory entry file name to %s\n", directory_table[insert_index].file_name);
-        flush_root_directory();
+        add_to_directory_index(insert_index);
+        mark_directory_entry_dirty(insert_index);
         return insert_index;
     } else {
         printf("Error: Cannot add entry to root directory as the directory contains no more free space!");
@@ -300,93 +1267,164 @@ int add_to_root_directory(int inode_no, char* file_name) {
 }
 
 /**
- * Takes an inode number corresponding to a file and allocates the file's nth block.
- * Updates the file's inode appropriately, but does NOT write it back to disk
- * Returns the block number of the allocated block, or -1 if the file cannot have an nth block
+ * Frees the blocks allocate_blocks_for_file took for blocks from through to of a file before it ran out of space,
+ * which are the ones was_hole says were holes, and makes them holes again. Frees was_hole
+ */
+void give_back_blocks(int inode_no, unsigned int *block_map, uint8_t *was_hole, int from, int to) {
+    for (int j = from; j <= to; j++) {
+        if (was_hole[j - from] && block_map[j] != 0) {
+            rm_index(block_map[j]);
+            block_map[j] = 0;
+            if (j < NUM_DIRECT_POINTERS) {
+                inode_table[inode_no].data_ptrs[j] = 0;
+            }
+        }
+    }
+    free(was_hole);
+}
+
+/**
+ * Allocates a block for every hole among blocks from through to (inclusive) of the file with inode inode_no, whose
+ * block_map has room for them. Blocks past the end of the file are holes (0) in block_map. The blocks are handed
+ * out in contiguous runs (extents) where possible, carrying on from the block before each run of holes.
+ * Records the new blocks in block_map and in the file's inode and indirect blocks, getting any indirect blocks
+ * that are missing first, so that nothing changes if there aren't enough free blocks.
+ * Does NOT write the inode back to disk
+ * Returns 0 on success, or -1 if the file cannot have that many blocks or the disk is full
  */
-int allocate_nth_block_for_file_with_inode(int inode_no, int nth) {
+int allocate_blocks_for_file(int inode_no, unsigned int *block_map, int from, int to) {
     // Error checking
-    if (nth < 0) {
+    if (from < 0) {
         printf("Error: Cannot allocate a negative block number.\n");
         return -1;
     }
-    if (nth > MAX_BLOCKS_PER_FILE - 1) {
+    if (to > MAX_BLOCKS_PER_FILE - 1) {
         printf("Error: The file has already consumed the maximum allowable number of blocks.\n");
         return -1;
     }
-    // Get new block
-    int block_no = get_index();
-    // Update inode
-    if (nth < NUM_DIRECT_POINTERS) {
-        inode_table[inode_no].data_ptrs[nth] = block_no;
-    } else if (nth == NUM_DIRECT_POINTERS) {
-        // We are allocating the first block that requires use of the inode's indirect pointer,
-        // so first we need to allocate a block for the indirect pointer
-        int ind_ptrs_block = get_index();
-        inode_table[inode_no].indirect_ptr = ind_ptrs_block;
-        // Have to write an entire block's worth of data to disk, so create an array of an unnecessarily large size
-        int indirect_ptrs[NUM_INDIRECT_POINTERS];
-        indirect_ptrs[0] = block_no;
-        // Write the indirect_ptrs to disk
-        write_blocks(ind_ptrs_block, 1, indirect_ptrs);
+    // Remember which blocks were holes, to put them back if the disk turns out to be full
+    uint8_t *was_hole = malloc(to - from + 1);
+    if (was_hole == NULL) {
+        printf("Error: Could not allocate memory to allocate blocks.\n");
+        return -1;
+    }
+    for (int i = from; i <= to; i++) {
+        was_hole[i - from] = (block_map[i] == 0);
+    }
+    unsigned int goal = (from > 0 && block_map[from - 1] != 0) ? block_map[from - 1] + 1 : 0;
+    for (int i = from; i <= to; ) {
+        if (block_map[i] != 0) {
+            goal = block_map[i] + 1;
+            i++;
+            continue;
+        }
+        int want = 1;
+        while (i + want <= to && block_map[i + want] == 0) {
+            want++;
+        }
+        int len;
+        unsigned int start = get_index_run(goal, want, &len);
+        if (len == 0) {
+            printf("Error: The disk is full.\n");
+            give_back_blocks(inode_no, block_map, was_hole, from, to);
+            return -1;
+        }
+        for (int j = 0; j < len; j++, i++) {
+            block_map[i] = start + j;
+            if (i < NUM_DIRECT_POINTERS) {
+                inode_table[inode_no].data_ptrs[i] = block_map[i];
+            }
+        }
+        goal = start + len;
+    }
+    if (to < NUM_DIRECT_POINTERS) {
+        free(was_hole);
+        return 0;
+    }
 
-    } else {
-        // Read the block of indirect pointers for the file into memory, modify it, and write it back
-        char ind_ptrs[BLOCK_SZ];
-        read_blocks(inode_table[inode_no].indirect_ptr, 1, ind_ptrs);
-        int indirect_ptrs[NUM_INDIRECT_POINTERS];
-        memcpy(indirect_ptrs, ind_ptrs, sizeof(indirect_ptrs));
-        indirect_ptrs[nth - NUM_DIRECT_POINTERS] = block_no;
-        write_blocks(inode_table[inode_no].indirect_ptr, 1, indirect_ptrs);
+    // Work out which trees of indirect blocks the new blocks go in, and how many indirect blocks those trees
+    // are missing, and get them all before changing any of the trees
+    int tree_first[NUM_INDIRECT_LEVELS + 1];
+    int tree_last[NUM_INDIRECT_LEVELS + 1];
+    int num_new = 0;
+    long long base = NUM_DIRECT_POINTERS;
+    for (int level = 1; level <= NUM_INDIRECT_LEVELS; level++) {
+        long long span = get_blocks_per_pointer(level + 1);
+        tree_first[level] = ((from > base) ? from : base) - base;
+        tree_last[level] = ((to < base + span - 1) ? to : base + span - 1) - base;
+        if (tree_first[level] <= tree_last[level]) {
+            num_new += count_missing_indirect_blocks(*get_indirect_root(inode_no, level), level, 0,
+                                                     tree_first[level], tree_last[level]);
+        }
+        base += span;
+    }
+    unsigned int *new_blocks = malloc((num_new + 1) * sizeof(unsigned int));
+    for (int n = 0; n < num_new; n++) {
+        int index = (new_blocks != NULL) ? get_index() : -1;
+        if (index == -1) {
+            printf("Error: Could not get the indirect blocks the file needs.\n");
+            for (int j = 0; j < n; j++) {
+                rm_index(new_blocks[j]);
+            }
+            free(new_blocks);
+            give_back_blocks(inode_no, block_map, was_hole, from, to);
+            return -1;
+        }
+        new_blocks[n] = index;
     }
-    return block_no;
-}
 
-/**
- * Takes a number corresponding to the nth consecutive block of the file with the given inode,
- * and determines if the file has such a block or not. Returns 1 if it does, and 0 if not.
- */
-int file_has_nth_block(int inode_no, int nth) {
-    // Need to check for the case that the inode size is zero, as if it is then we know the file
-    // is empty and therefore has no blocks allocated to it yet
-    if (inode_table[inode_no].size / BLOCK_SZ < nth || inode_table[inode_no].size == 0) {
-        return 0;
-    } else {
-        return 1;
+    // Link the new blocks into the trees, starting new trees at the inode's pointers
+    unsigned int *next_new = new_blocks;
+    base = NUM_DIRECT_POINTERS;
+    for (int level = 1; level <= NUM_INDIRECT_LEVELS; level++) {
+        if (tree_first[level] <= tree_last[level]) {
+            unsigned int *root = get_indirect_root(inode_no, level);
+            int fresh = (*root == 0);
+            if (fresh) {
+                *root = *next_new++;
+            }
+            link_pointer_tree(*root, fresh, level, 0, block_map + base, tree_first[level], tree_last[level], &next_new);
+        }
+        base += get_blocks_per_pointer(level + 1);
     }
+    free(new_blocks);
+    free(was_hole);
+    return 0;
 }
 
 /**
  * Resets the directory entry at a given index
  */
 void reset_directory_entry_at_index(int index) {
-    // All this involves is setting the inode number back to 0
+    // All this involves is taking the entry out of the hash index and setting the inode number back to 0
+    remove_from_directory_index(index);
     directory_table[index].inode_no = 0;
+    release_id(&directory_pool, index);
+    mark_directory_entry_dirty(index);
 }
 
 /**
  * Frees all blocks used by the file with inode number inode_no
  */
 void free_blocks_used_by_inode(int inode_no) {
-    if (inode_table[inode_no].size == 0) {
-        // Nothing was ever written to the file so no blocks to free
+    if (inode_table[inode_no].size == 0 || (inode_table[inode_no].flags & INODE_INLINE)) {
+        // Nothing was ever written to the file, or it was all kept in the inode, so no blocks to free
         return;
     }
-    // Get the last block (we know the first is 0)
-    int last_block = get_sequential_block_number_containing_byte(inode_table[inode_no].size - 1);
-
-    // Free the blocks
-    for (int i = 0; i <= last_block; i++) {
-        int block_no = get_block_number_corresponding_to_nth_block_for_file(inode_no, i);
-        rm_index(block_no);
+    int num_blocks = get_number_of_blocks_for_size(inode_table[inode_no].size);
+    for (int i = 0; i < num_blocks && i < NUM_DIRECT_POINTERS; i++) {
+        if (inode_table[inode_no].data_ptrs[i] != 0) {
+            rm_index(inode_table[inode_no].data_ptrs[i]);
+        }
     }
 
-    // We also might need to free the block of indirect pointers, if there is one!
-    if (last_block >= NUM_DIRECT_POINTERS) {
-        // A block was allocated for indirect pointers
-        rm_index(inode_table[inode_no].indirect_ptr);
+    // We also might need to free the blocks the indirect pointers lead to, and the indirect blocks themselves!
+    long long base = NUM_DIRECT_POINTERS;
+    for (int level = 1; level <= NUM_INDIRECT_LEVELS && base < num_blocks; level++) {
+        long long span = get_blocks_per_pointer(level + 1);
+        free_pointer_tree(*get_indirect_root(inode_no, level), level, (num_blocks - base < span) ? num_blocks - base : span);
+        base += span;
     }
-
 }
 
 /**
@@ -397,8 +1435,11 @@ void reset_inode_table_entry(int inode_no) {
     inode_table[inode_no].size = 0;
     // Set is_used to 0
     inode_table[inode_no].is_used = 0;
-    // Reset indirect_ptr (for safety)
-    inode_table[inode_no].indirect_ptr = 0;
+    // Reset the pointers, or the inline data they share their space with (for safety)
+    inode_table[inode_no].flags = 0;
+    memset(inode_table[inode_no].inline_data, 0, INODE_INLINE_DATA_SIZE);
+    release_id(&inode_pool, inode_no);
+    mark_inode_dirty(inode_no);
 }
 
 /*********************
@@ -406,121 +1447,281 @@ void reset_inode_table_entry(int inode_no) {
  *********************/
 
 void init_superblock() {
-    sb.magic = 0xACBD0005;
+    sb.magic = SFS_MAGIC;
     sb.block_size = BLOCK_SZ;
-    sb.fs_size = NUM_BLOCKS * BLOCK_SZ;
+    sb.fs_size = (unsigned int) ((unsigned long long) NUM_BLOCKS * BLOCK_SZ);
     sb.inode_table_len = NUM_INODE_BLOCKS;
     sb.root_dir_inode = 0; // The first inode in the inode table is for the root directory
+    sb.journal_start = 1 + NUM_BIT_MAP_BLOCKS + NUM_INODE_BLOCKS;
+    sb.journal_len = JOURNAL_BLOCKS;
+    sb.num_blocks = NUM_BLOCKS;
+    sb.num_inodes = NUM_INODES;
 }
 
 /**
- * Initializes the first inode entry in the inode table with the information for the root directory
+ * Initializes the first inode entry in the inode table with the information for the root directory, and gives
+ * the root directory its blocks
+ * Returns 0 on success and -1 if the disk is too small for the root directory
  */
-void init_root_dir_inode() {
-
-     printf("Right inside init_rdi\n");
-     inode_table[0].size = ROOT_DIRECTORY_SIZE_IN_BYTES;
-     inode_table[0].is_used = 1;
-     printf("Set inode table entry 0 size and is used\n");
-
-     int indirect_ptrs[NUM_INDIRECT_POINTERS];
-     printf("Blocks for root directory: %d\n", ROOT_DIRECTORY_SIZE_IN_BLOCKS);
-     // Determine the blocks that will store the root directory table
-     for(int i = 0; i < ROOT_DIRECTORY_SIZE_IN_BLOCKS; i++) {
-         int index = get_index(); // Get next free index in the bitmap
-         if (i < NUM_DIRECT_POINTERS) {
-             printf("Adding a direct pointer\n");
-             inode_table[0].data_ptrs[i] = index;
-         } else if (i == NUM_DIRECT_POINTERS) {
-             printf("Adding first indirect pointer\n");
-             // set the indirect ptr to point to a block
-             inode_table[0].indirect_ptr = index;
-             // Get another block number for the 12th block of the directory table
-             index = get_index();
-             indirect_ptrs[0] = index;
-         } else {
-             printf("Adding indirect pointer number %d\n", i - 11);
-             indirect_ptrs[i - NUM_DIRECT_POINTERS] = index;
-         }
-     }
-
-     // Write the block of indirect pointers to disk, if necessary
-     if (inode_table[0].indirect_ptr != 0) {
-         printf("Writing indirect pointers to disk\n");
-         write_blocks(inode_table[0].indirect_ptr, 1, indirect_ptrs);
-         printf("Wrote indirect pointers to disk\n");
-     }
-
+int init_root_dir_inode() {
+    inode_table[0].size = ROOT_DIRECTORY_SIZE_IN_BYTES;
+    inode_table[0].is_used = 1;
+    printf("Blocks for root directory: %d\n", ROOT_DIRECTORY_SIZE_IN_BLOCKS);
+    // The root directory's blocks are allocated like any file's, so a large directory table gets indirect blocks
+    unsigned int *block_map = calloc(ROOT_DIRECTORY_SIZE_IN_BLOCKS, sizeof(unsigned int));
+    int result = -1;
+    if (block_map != NULL) {
+        result = allocate_blocks_for_file(0, block_map, 0, ROOT_DIRECTORY_SIZE_IN_BLOCKS - 1);
+    }
+    free(block_map);
+    if (result == -1) {
+        printf("Error: Could not get the blocks for the root directory.\n");
+    }
+    return result;
 }
 
 /**
- * Sets the properties for the inode at index inode_no of the inode_table, and flushes the inode table to disk
+ * Sets the properties for the inode at index inode_no of the inode_table, and marks its block of the inode table dirty.
+ * The file starts out with its data in the inode, unless inline data is turned off
  */
 void initialize_new_inode(int inode_no) {
     inode_table[inode_no].size = 0;
     inode_table[inode_no].is_used = 1;
-    flush_inode_table();
+    inode_table[inode_no].flags = inline_data_on ? INODE_INLINE : 0;
+    memset(inode_table[inode_no].inline_data, 0, INODE_INLINE_DATA_SIZE);
+    mark_inode_dirty(inode_no);
 }
 
-/*********************
- * Restoration helpers
- *********************/
-
-void restore_superblock() {
-    printf("Size of sb: %d\n", sizeof(sb));
-    char sup_block[BLOCK_SZ];
-    read_blocks(0, 1, sup_block);
-    memcpy(&sb, sup_block, sizeof(sb));
-    printf("Restored superblock\n");
+/**
+ * Sets up the locks that can't be statically initialized, the first time a file system is made or opened
+ */
+void init_locks() {
+    if (locks_initialized) {
+        return;
+    }
+    // Prefer writers, so that a steady stream of operations cannot hold off a journal commit forever
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&journal_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    locks_initialized = 1;
 }
 
-void restore_free_bit_map() {
-    char fbm[BLOCK_SZ * NUM_BIT_MAP_BLOCKS];
-    read_blocks(1, NUM_BIT_MAP_BLOCKS, fbm);
-    memcpy(free_bit_map, fbm, sizeof(free_bit_map));
-    printf("Restored free bit map\n");
+/**
+ * Checks that a file system with the given geometry can be made: the block size is a power of 2 of at least
+ * MIN_BLOCK_SZ bytes, there is an inode for at least one file, and the superblock, free bit map, inode table,
+ * journal and root directory leave room for data on the disk.
+ * Returns 0 if it can and -1 if not
+ */
+int check_geometry(int block_size, int num_blocks, int num_inodes) {
+    if (block_size < MIN_BLOCK_SZ || (block_size & (block_size - 1)) != 0) {
+        printf("Error: The block size must be a power of 2 of at least %d bytes.\n", MIN_BLOCK_SZ);
+        return -1;
+    }
+    if (num_inodes < 2) {
+        printf("Error: A file system needs at least 2 inodes, as the first is the root directory's.\n");
+        return -1;
+    }
+    // Work out the size of the metadata from the same macros the rest of the file system uses
+    geometry_t open_geometry = geometry;
+    geometry = (geometry_t) { block_size, num_blocks, num_inodes };
+    long long metadata_blocks = 1 + NUM_BIT_MAP_BLOCKS + NUM_INODE_BLOCKS + JOURNAL_BLOCKS + ROOT_DIRECTORY_SIZE_IN_BLOCKS;
+    geometry = open_geometry;
+    if (num_blocks <= metadata_blocks) {
+        printf("Error: A disk of %d blocks is too small for %lld blocks of metadata.\n", num_blocks, metadata_blocks);
+        return -1;
+    }
+    return 0;
 }
 
-void restore_inode_table() {
-    char itable[NUM_INODE_BLOCKS * BLOCK_SZ];
-    printf("inode table length should be: %d\n", NUM_INODE_BLOCKS);
-    printf("inode table length: %d\n", sb.inode_table_len);
-    printf("Number of bit map blocks: %d\n", NUM_BIT_MAP_BLOCKS);
-    read_blocks(1 + NUM_BIT_MAP_BLOCKS, 1, itable);
-    memcpy(inode_table, itable, sizeof(inode_table));
-    //read_blocks(1, 1, itable);
-    printf("Restored inode table\n");
-    //fflush(stdout);
+/**
+ * Frees the in-memory tables of the file system that was open, and the buffers of its open files
+ */
+void free_tables() {
+    if (fd_table != NULL) {
+        for (int i = 0; i < FD_TABLE_SIZE; i++) {
+            free(fd_table[i].block_map);
+            free(fd_table[i].append_buf);
+        }
+    }
+    if (inode_locks != NULL) {
+        for (int i = 0; i < NUM_INODES; i++) {
+            pthread_rwlock_destroy(&inode_locks[i]);
+        }
+    }
+    free(inode_table);
+    free(directory_table);
+    free(free_bit_map);
+    free(dirty_bit_map_blocks);
+    free(dirty_inode_blocks);
+    free(dirty_directory_blocks);
+    free(inode_locks);
+    free(fd_table);
+    free(fd_for_inode);
+    free(dir_hash_heads);
+    free(dir_hash_next);
+    inode_table = NULL;
+    directory_table = NULL;
+    free_bit_map = NULL;
+    dirty_bit_map_blocks = NULL;
+    dirty_inode_blocks = NULL;
+    dirty_directory_blocks = NULL;
+    inode_locks = NULL;
+    fd_table = NULL;
+    fd_for_inode = NULL;
+    dir_hash_heads = NULL;
+    dir_hash_next = NULL;
 }
 
-void restore_directory_table() {
-    char dir_table[ROOT_DIRECTORY_SIZE_IN_BLOCKS * BLOCK_SZ];
-    //char* p = (char *) directory_table;
-    for (int i = 0, j = 0; i < ROOT_DIRECTORY_SIZE_IN_BLOCKS; i++, j += BLOCK_SZ) {
-       printf("i: %d, j: %d\n", i, j);
-       int block_no = get_block_number_corresponding_to_nth_block_for_file(0, i);
-       read_blocks(block_no, 1, dir_table + j);
+/**
+ * Replaces the in-memory tables of the file system that was open (if any) with empty ones sized for the given
+ * geometry, which becomes the geometry of the file system. Every block starts out free in the free bit map,
+ * and every fd closed.
+ * Returns 0 on success and -1 if out of memory
+ */
+int alloc_tables(int block_size, int num_blocks, int num_inodes) {
+    free_tables();
+    geometry = (geometry_t) { block_size, num_blocks, num_inodes };
+    inode_table = calloc(NUM_INODES, sizeof(inode_t));
+    directory_table = calloc(MAX_DIRECTORY_ENTRIES, sizeof(directory_entry_t));
+    free_bit_map = malloc(BIT_MAP_SIZE);
+    dirty_bit_map_blocks = calloc(NUM_BIT_MAP_BLOCKS, 1);
+    dirty_inode_blocks = calloc(NUM_INODE_BLOCKS, 1);
+    dirty_directory_blocks = calloc(ROOT_DIRECTORY_SIZE_IN_BLOCKS, 1);
+    inode_locks = malloc(NUM_INODES * sizeof(pthread_rwlock_t));
+    fd_table = calloc(FD_TABLE_SIZE, sizeof(file_descriptor_t));
+    fd_for_inode = malloc(NUM_INODES * sizeof(int));
+    dir_hash_heads = malloc(DIR_HASH_SIZE * sizeof(int));
+    dir_hash_next = malloc(MAX_DIRECTORY_ENTRIES * sizeof(int));
+    if (inode_table == NULL || directory_table == NULL || free_bit_map == NULL || dirty_bit_map_blocks == NULL
+        || dirty_inode_blocks == NULL || dirty_directory_blocks == NULL || inode_locks == NULL || fd_table == NULL
+        || fd_for_inode == NULL || dir_hash_heads == NULL || dir_hash_next == NULL) {
+        printf("Error: Could not allocate memory for the file system's tables.\n");
+        free(inode_locks);
+        inode_locks = NULL;
+        free_tables();
+        return -1;
     }
-    memcpy(directory_table, dir_table, sizeof(directory_table));
-    printf("Restored directory table\n");
+    memset(free_bit_map, UINT8_MAX, BIT_MAP_SIZE);
+    for (int i = 0; i < NUM_INODES; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    return 0;
 }
 
-void restore_all() {
-    restore_superblock();
-    restore_free_bit_map();
+/*********************
+ * Restoration helpers
+ *********************/
+
+/**
+ * Reads an in-memory table of table_size bytes from the blocks starting at block first_block, where write_table put it
+ */
+void read_table(int first_block, void *table, size_t table_size) {
+    int nblocks = (table_size + BLOCK_SZ - 1) / BLOCK_SZ;
+    char *blocks = malloc((size_t) nblocks * BLOCK_SZ);
+    cached_read_blocks(first_block, nblocks, blocks);
+    memcpy(table, blocks, table_size);
+    free(blocks);
+}
+
+/**
+ * Reads the superblock straight from the disk file, rather than through disk_emu, as the block size the disk
+ * has to be opened with is in the superblock.
+ * Returns 0 on success and -1 if the disk file can't be read or doesn't hold a file system of this version
+ */
+int restore_superblock() {
+    printf("Size of sb: %zu\n", sizeof(sb));
+    FILE *disk = fopen(KEITHS_DISK, "rb");
+    if (disk == NULL) {
+        printf("Error: Could not open %s.\n", KEITHS_DISK);
+        return -1;
+    }
+    size_t read = fread(&sb, sizeof(sb), 1, disk);
+    fclose(disk);
+    if (read != 1 || (sb.magic & 0xFFFF0000) != (SFS_MAGIC & 0xFFFF0000)) {
+        printf("Error: %s does not hold a file system.\n", KEITHS_DISK);
+        return -1;
+    }
+    if (sb.magic != SFS_MAGIC) {
+        printf("Error: %s holds a file system of version %u, but this is version %u.\n", KEITHS_DISK,
+               sb.magic & 0xFFFF, SFS_MAGIC & 0xFFFF);
+        return -1;
+    }
+    printf("Restored superblock\n");
+    return 0;
+}
+
+void restore_free_bit_map() {
+    read_table(1, free_bit_map, BIT_MAP_SIZE);
+    printf("Restored free bit map\n");
+}
+
+void restore_inode_table() {
+    printf("inode table length should be: %d\n", NUM_INODE_BLOCKS);
+    printf("inode table length: %d\n", sb.inode_table_len);
+    printf("Number of bit map blocks: %d\n", NUM_BIT_MAP_BLOCKS);
+    read_table(1 + NUM_BIT_MAP_BLOCKS, inode_table, INODE_TABLE_SIZE_IN_BYTES);
+    printf("Restored inode table\n");
+}
+
+void restore_directory_table() {
+    char *p = (char *) directory_table;
+    for (int i = 0, j = 0; i < ROOT_DIRECTORY_SIZE_IN_BLOCKS; i++, j += BLOCK_SZ) {
+       printf("i: %d, j: %d\n", i, j);
+       int block_no = get_block_number_corresponding_to_nth_block_for_file(0, i);
+       int len = (ROOT_DIRECTORY_SIZE_IN_BYTES - j < BLOCK_SZ) ? ROOT_DIRECTORY_SIZE_IN_BYTES - j : BLOCK_SZ;
+       cached_read_bytes(block_no, 0, len, p + j);
+    }
+    rebuild_directory_index();
+    printf("Restored directory table\n");
+}
+
+void restore_all() {
+    memset(dirty_bit_map_blocks, BLOCK_CLEAN, NUM_BIT_MAP_BLOCKS);
+    memset(dirty_inode_blocks, BLOCK_CLEAN, NUM_INODE_BLOCKS);
+    memset(dirty_directory_blocks, BLOCK_CLEAN, ROOT_DIRECTORY_SIZE_IN_BLOCKS);
+    replay_journal();
+    restore_free_bit_map();
     restore_inode_table();
     restore_directory_table();
+    rebuild_free_lists();
 }
 
 /*********************************************************************************
  ************************************** API **************************************
  *********************************************************************************/
 
-void mksfs(int fresh) {
+/**
+ * Makes a new file system with blocks of block_size bytes, num_blocks blocks and num_inodes inodes if fresh is 1,
+ * or opens the existing one if fresh is 0, in which case its geometry comes from its superblock and the
+ * arguments are ignored. Either way, the in-memory tables are sized for the file system's geometry.
+ * Returns 0 on success and -1 if error
+ */
+int mksfs_with_geometry(int fresh, int block_size, int num_blocks, int num_inodes) {
+    init_locks();
+    memset(&readahead_stats, 0, sizeof(readahead_stats));
     if (fresh) {
+        if (check_geometry(block_size, num_blocks, num_inodes) == -1) {
+            return -1;
+        }
         printf("making new file system\n");
+        // Start from empty tables, in case another file system was made or opened earlier in this process
+        if (alloc_tables(block_size, num_blocks, num_inodes) == -1) {
+            return -1;
+        }
+        next_free_bit_hint = 0;
 
-        init_fresh_disk(KEITHS_DISK, BLOCK_SZ, NUM_BLOCKS);
+        // The new disk file is sparse, so every piece of metadata below is written out in full rather than
+        // relying on what the file held before
+        set_disk_durability(durability_mode);
+        if (init_fresh_disk(KEITHS_DISK, BLOCK_SZ, NUM_BLOCKS, KEITHS_DISK_BACKEND) == -1) {
+            return -1;
+        }
+        if (init_async_io(KEITHS_ASYNC_ENGINE, ASYNC_QUEUE_DEPTH) < 0 || init_block_cache(CACHE_CAPACITY, BLOCK_SZ) == -1) {
+            close_disk();
+            return -1;
+        }
 
         printf("Init fresh disk passed\n");
         /**
@@ -551,8 +1752,22 @@ void mksfs(int fresh) {
             get_index();
         }
         printf("Got blocks for inode table\n");
+        /**
+         * JOURNAL
+         */
+        // Reserve blocks for the metadata journal, right after the inode table
+        for (int i = 0; i < JOURNAL_BLOCKS; i++) {
+            get_index();
+        }
+        zero_blocks(sb.journal_start, JOURNAL_BLOCKS);
+        printf("Got blocks for journal\n");
         // Set the first entry in the inode table to be an inode_t for the root directory
-        init_root_dir_inode();
+        if (init_root_dir_inode() == -1) {
+            return -1;
+        }
+        // The directory starts out empty
+        rebuild_directory_index();
+        rebuild_free_lists();
 
         printf("Initialized root directory\n");
         // write inode table to disk
@@ -563,16 +1778,43 @@ void mksfs(int fresh) {
         flush_free_bit_map();
 
         printf("Wrote bit map to disk\n");
+        flush_root_directory();
+        journal_tail = 0;
+        journal_sequence = 1;
+        journal_pending_ops = 0;
+        write_journal_header(journal_sequence);
+
+        // Make sure the empty file system reaches the disk, rather than only the block cache
+        sfs_sync();
 
     } else {
         printf("reopening file system\n");
-        // initialize the disk
-        init_disk(KEITHS_DISK, BLOCK_SZ, NUM_BLOCKS);
+        if (restore_superblock() == -1 || check_geometry(sb.block_size, sb.num_blocks, sb.num_inodes) == -1
+            || alloc_tables(sb.block_size, sb.num_blocks, sb.num_inodes) == -1) {
+            return -1;
+        }
+        // initialize the disk, and don't go on to read the metadata from one that couldn't be opened
+        set_disk_durability(durability_mode);
+        if (init_disk(KEITHS_DISK, BLOCK_SZ, NUM_BLOCKS, KEITHS_DISK_BACKEND) == -1) {
+            return -1;
+        }
+        if (init_async_io(KEITHS_ASYNC_ENGINE, ASYNC_QUEUE_DEPTH) < 0 || init_block_cache(CACHE_CAPACITY, BLOCK_SZ) == -1) {
+            close_disk();
+            return -1;
+        }
 
         restore_all();
     }
 
-	  return;
+	  return 0;
+}
+
+/**
+ * Makes a new file system with the default geometry (DEFAULT_BLOCK_SZ, DEFAULT_NUM_BLOCKS and DEFAULT_NUM_INODES)
+ * if fresh is 1, or opens the existing one, whatever its geometry, if fresh is 0
+ */
+void mksfs(int fresh) {
+    mksfs_with_geometry(fresh, DEFAULT_BLOCK_SZ, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES);
 }
 
 /***
@@ -586,16 +1828,19 @@ void mksfs(int fresh) {
  * Returns 1 if it found a file to copy into fname and 0 otherwise
  */
 int sfs_getnextfilename(char *fname) {
+    pthread_mutex_lock(&directory_lock);
     int next_file_index = get_next_filled_directory_entry_starting_at(next_dir_index + 1);
 
     if (next_file_index == -1) {
         // Reset next_dir_index to -1 and return 0
         next_dir_index = -1;
+        pthread_mutex_unlock(&directory_lock);
         return 0;
     } else {
         // Copy the name of the file into fname, update next_dir_index, and return 1
         strcpy(fname, directory_table[next_file_index].file_name);
         next_dir_index = next_file_index;
+        pthread_mutex_unlock(&directory_lock);
         return 1;
     }
 }
@@ -605,7 +1850,7 @@ int sfs_getnextfilename(char *fname) {
  * Path is the name of the file
  * Returns the file size, in bytes, if the file exists, and -1 otherwise
  */
-int sfs_getfilesize(const char* path) {
+int64_t sfs_getfilesize(const char* path) {
     char filename[MAXFILENAME];
     // If the first character is a '/', drop it
     printf("First char is: %c\n", *path);
@@ -617,12 +1862,19 @@ int sfs_getfilesize(const char* path) {
         strcpy(filename, path);
     }
     printf("The file name is now: %s\n", path);
+    int64_t size = -1;
+    pthread_mutex_lock(&directory_lock);
     int index = get_directory_index_for_file_with_name(path);
     if (index != -1) {
         // The file exists, so it's inode must be in memory, assuming we've ensured to save it to memory...
-        return inode_table[directory_table[index].inode_no].size;
+        int inode_no = directory_table[index].inode_no;
+        pthread_rwlock_rdlock(&inode_locks[inode_no]);
+        int fd = fd_for_inode[inode_no];
+        size = (fd != -1) ? get_size_of_open_file(fd) : inode_table[inode_no].size;
+        pthread_rwlock_unlock(&inode_locks[inode_no]);
     }
-    return -1;
+    pthread_mutex_unlock(&directory_lock);
+    return size;
 }
 
 /**
@@ -632,8 +1884,9 @@ int sfs_getfilesize(const char* path) {
  * its size to zero
  * If it exists, the file is opened in append mode (the rwpointer is set to the
  * end of the file)
+ * open_file does the work; the caller must hold directory_lock inside a journal_begin/journal_end pair
  */
-int sfs_fopen(char *name) {
+int open_file(char *name) {
 
     // If file exists, then open it in append mode
     // else,
@@ -688,11 +1941,18 @@ int sfs_fopen(char *name) {
             initialize_new_inode(inode_no);
             // Add the file to the fd_table
             int fd = add_to_fd_table(inode_no, 0);
-            if (fd != -1) {
-                printf("Adding the file to the root directory\n");
-                // Add the file to the root directory
-                add_to_root_directory(inode_no, name);
+            if (fd == -1) {
+                reset_inode_table_entry(inode_no);
+                return -1;
+            }
+            printf("Adding the file to the root directory\n");
+            // Add the file to the root directory, or give back the fd and the inode if it is full
+            if (add_to_root_directory(inode_no, name) == -1) {
+                remove_from_fd_table(fd);
+                reset_inode_table_entry(inode_no);
+                return -1;
             }
+            journal_metadata_changes();
             printf("The file descriptor is: %d", fd);
             return fd;
         } else {
@@ -702,26 +1962,58 @@ int sfs_fopen(char *name) {
     }
 }
 
+int sfs_fopen(char *name) {
+    journal_begin();
+    pthread_mutex_lock(&directory_lock);
+    int fd = open_file(name);
+    pthread_mutex_unlock(&directory_lock);
+    journal_end();
+    return fd;
+}
+
 /**
- * Closes a file. All this involves is resetting the entry at index fileID
- * from the file descriptor table
- * Returns 0 on success and -1 number otherwise
+ * Move the rwpointer for the file corresponding to fd entry fileID
+ * to loc. i.e. change the rwptr property of the file_descriptor_t struct
+ * at index fileID of the file descriptor table to loc.
+ * loc may be past the end of the file: a write there leaves a hole between the old end of the file and the write
+ * Returns 0 if success and -1 if error (i.e. trying to move the rwpointer
+ * before the start of the file)
+ * seek_file does the work; the caller must hold the file's inode lock exclusively
  */
-int sfs_fclose(int fileID){
-    fd_table[fileID].inode_no = 0;
-    fd_table[fileID].rwptr = 0;
-    return 0;
+int seek_file(int fileID, int64_t loc){
+
+    /* Perform error checking:
+     * If loc is negative, this, of course, is not allowed
+     */
+    if (loc < 0) {
+        printf("Error: Attempting to seek before the start of a file.\n");
+        return -1;
+    }
+    fd_table[fileID].rwptr = loc;
+    printf("Seeked to byte %lld\n", (long long) loc);
+	  return 0;
+}
+
+int sfs_fseek(int fileID, int64_t loc){
+    if (!is_open_fd(fileID)) {
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int result = seek_file(fileID, loc);
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    return result;
 }
 
 /**
- * Read length bytes of the file corresponding to file descriptor
- * table entry fileID into buf, starting with the byte of the file indicated by the file's
- * rwpointer
- * Returns the number of bytes read
+ * Reads length bytes of the file corresponding to file descriptor table entry fileID into buf,
+ * starting with byte offset of the file. Doesn't touch the file's rwpointer.
+ * Returns the number of bytes read, which is less than length if the file ends first
+ * The caller must hold the file's inode lock, shared or exclusive
  */
-int sfs_fread(int fileID, char *buf, int length) {
+int read_file(int fileID, char *buf, int length, int64_t offset) {
 
-    printf("Rwptr at start of read: %d\n", fd_table[fileID].rwptr);
+    printf("Offset at start of read: %lld\n", (long long) offset);
 
 
     // Error checking
@@ -730,46 +2022,67 @@ int sfs_fread(int fileID, char *buf, int length) {
         return 0;
     }
 
-    // If rwptr + length exceeds the file size, we reset length to whatever it needs to be to
+    // If offset + length exceeds the file size, we reset length to whatever it needs to be to
     // reach the end of the file
-    if (fd_table[fileID].rwptr + length > inode_table[fd_table[fileID].inode_no].size) {
-        length = inode_table[fd_table[fileID].inode_no].size - fd_table[fileID].rwptr;
+    if (offset + length > get_size_of_open_file(fileID)) {
+        length = get_size_of_open_file(fileID) - offset;
         printf("Reset length of read to read only to end of file\n");
     }
+    if (length <= 0) {
+        return 0;
+    }
+
+    // Bytes past the end of the file's blocks are still in its append buffer
+    int total = length;
+    int64_t block_bytes = (int64_t) inode_table[fd_table[fileID].inode_no].size - offset;
+    if (block_bytes < length) {
+        int from = (block_bytes > 0) ? block_bytes : 0;
+        memcpy(buf + from, fd_table[fileID].append_buf + (offset + from - inode_table[fd_table[fileID].inode_no].size),
+               length - from);
+        length = from;
+        if (length == 0) {
+            return total;
+        }
+    }
+
+    // A small file's data is in its inode, which is always in memory
+    if (inode_table[fd_table[fileID].inode_no].flags & INODE_INLINE) {
+        memcpy(buf, inode_table[fd_table[fileID].inode_no].inline_data + offset, length);
+        return total;
+    }
 
     // Get the sequential numbers of the first and last blocks we need to read
-    int first_block = get_sequential_block_number_containing_byte(fd_table[fileID].rwptr);
-    int last_block = get_sequential_block_number_containing_byte(fd_table[fileID].rwptr + length - 1);
+    int first_block = get_sequential_block_number_containing_byte(offset);
+    int last_block = get_sequential_block_number_containing_byte(offset + length - 1);
     printf("Start block for read: %d\n", first_block);
     printf("End block for read: %d\n", last_block);
 
-    // Allocate a buffer to contain the data for all the blocks we need to read from disk
-    char temp_buf[(last_block - first_block + 1)*BLOCK_SZ];
-
-    // Iterate, reading one block at a time, and writing it to temp_buf
-    for (int i = first_block; i <= last_block; i++) {
-        int block_no = get_block_number_corresponding_to_nth_block_for_file(fd_table[fileID].inode_no, i);
-        read_blocks(block_no, 1, temp_buf + (first_block == 0 ? i : (i % first_block)) * BLOCK_SZ);
+    // Only the part we want of blocks the read covers partially (at most the first and the last) is copied out
+    // of the cache, and whole blocks go straight from the cache into buf
+    unsigned int *block_map = get_block_map_for_fd(fileID);
+    do_readahead(fileID, first_block, last_block);
+    int head = offset % BLOCK_SZ;           // Bytes of the first block before the read starts
+    int tail = (offset + length) % BLOCK_SZ; // Bytes of the last block the read covers, or 0 if it covers all of it
+    int whole_first = first_block;
+    int whole_last = last_block;
+    if (head != 0 || (first_block == last_block && tail != 0)) {
+        int n = (BLOCK_SZ - head < length) ? BLOCK_SZ - head : length;
+        read_block_bytes(block_map[first_block], head, n, buf);
+        whole_first++;
+    }
+    if (tail != 0 && last_block >= whole_first) {
+        read_block_bytes(block_map[last_block], 0, tail, buf + length - tail);
+        whole_last--;
+    }
+    if (whole_first <= whole_last) {
+        int skip = (whole_first > first_block) ? BLOCK_SZ - head : 0;
+        read_whole_blocks(block_map, whole_first, whole_last, buf + skip);
     }
 
-    // Copy the bytes we want from temp_buf into buf
-    memcpy(buf, temp_buf + (fd_table[fileID].rwptr % BLOCK_SZ), length);
-    printf("buf is now: %s\n", buf);
-
-    // Lastly, we need to increase the rwptr for the file
-    /*if (fd_table[fileID].rwptr + length == inode_table[fd_table[fileID].inode_no].size) {
-        // Seek to the last byte of the file
-        sfs_fseek(fileID, fd_table[fileID].rwptr + length - 1);
-    } else {
-        // Seek to the first byte after the sequence you just read
-        sfs_fseek(fileID, fd_table[fileID].rwptr + length);
-    }*/
-    // Seek to the first byte after the sequence you just read
-    sfs_fseek(fileID, fd_table[fileID].rwptr + length - 1);
-
+    printf("buf is now: %.*s\n", total, buf);
     printf("Done read\n");
 
-    return length;
+    return total;
     /*file_descriptor_t* f = &fd_table[fileID];
     inode_t* n = &inode_table[f->inode];
     int block = n->data_ptrs[0];
@@ -778,20 +2091,129 @@ int sfs_fread(int fileID, char *buf, int length) {
 }
 
 /**
- * Writes length bytes of buf into the file at index fileID of
- * the file descriptor table, starting at the byte of the current rwpointer
- * as determined from the file descriptor table.
- * This could increase the size of the file.
+ * Read length bytes of the file corresponding to file descriptor
+ * table entry fileID into buf, starting with the byte of the file indicated by the file's
+ * rwpointer. The file's inode lock is held exclusively, as the rwpointer moves, so reads that are to run in
+ * parallel should use sfs_pread
+ * Returns the number of bytes read
+ */
+int sfs_fread(int fileID, char *buf, int length) {
+    if (!is_open_fd(fileID)) {
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int64_t rwptr = fd_table[fileID].rwptr;
+    int result = read_file(fileID, buf, length, rwptr);
+    if (result > 0) {
+        // Lastly, we need to increase the rwptr for the file
+        /*if (fd_table[fileID].rwptr + length == inode_table[fd_table[fileID].inode_no].size) {
+            // Seek to the last byte of the file
+            sfs_fseek(fileID, fd_table[fileID].rwptr + length - 1);
+        } else {
+            // Seek to the first byte after the sequence you just read
+            sfs_fseek(fileID, fd_table[fileID].rwptr + length);
+        }*/
+        // Seek to the first byte after the sequence you just read
+        seek_file(fileID, rwptr + result - 1);
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    return result;
+}
+
+/**
+ * Reads length bytes of the file corresponding to file descriptor table entry fileID into buf, starting at byte
+ * offset of the file, without using or moving the file's rwpointer
+ * Returns the number of bytes read (0 at or past the end of the file), or -1 if error
+ */
+int sfs_pread(int fileID, char *buf, int length, int64_t offset) {
+    if (!is_open_fd(fileID)) {
+        return -1;
+    }
+    if (offset < 0) {
+        printf("Error: Attempting to read before the start of a file.\n");
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    pthread_rwlock_rdlock(&inode_locks[inode_no]);
+    int result = read_file(fileID, buf, length, offset);
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    return result;
+}
+
+/**
+ * Writes length bytes of buf into the inline data of the file with inode inode_no, starting at byte offset, which
+ * with length must be within INODE_INLINE_DATA_SIZE. A gap between the end of the file and the write reads as zeros.
+ * The data goes to disk with the inode, in the next journal commit.
+ * Returns length
+ * The caller must hold the file's inode lock exclusively, inside a journal_begin/journal_end pair
+ */
+int write_inline_data(int inode_no, const char *buf, int length, int64_t offset) {
+    inode_t *inode = &inode_table[inode_no];
+    if (offset > (int64_t) inode->size) {
+        memset(inode->inline_data + inode->size, 0, offset - inode->size);
+    }
+    memcpy(inode->inline_data + offset, buf, length);
+    if (offset + length > (int64_t) inode->size) {
+        inode->size = offset + length;
+    }
+    mark_inode_dirty(inode_no);
+    journal_metadata_changes();
+    return length;
+}
+
+/**
+ * Moves the data of the open file at index fileID of the fd table out of its inode and into blocks, for a write
+ * that takes the file past INODE_INLINE_DATA_SIZE bytes. The blocks are allocated together and written whole, and
+ * the file keeps its size.
+ * Returns 0 on success, or -1 if the disk is full, in which case the data stays in the inode
+ * The caller must hold the file's inode lock exclusively, inside a journal_begin/journal_end pair
+ */
+int move_inline_data_to_blocks(int fileID) {
+    int inode_no = fd_table[fileID].inode_no;
+    inode_t *inode = &inode_table[inode_no];
+    int num_blocks = get_number_of_blocks_for_size(inode->size);
+    char *data = calloc(num_blocks + 1, BLOCK_SZ);
+    if (data == NULL || grow_block_map(fileID, num_blocks + 1) == -1) {
+        printf("Error: Could not allocate memory to move a file's data out of its inode.\n");
+        free(data);
+        return -1;
+    }
+    memcpy(data, inode->inline_data, inode->size);
+    // The pointers share their space with the data, so they start out as holes
+    memset(inode->inline_data, 0, INODE_INLINE_DATA_SIZE);
+    inode->flags &= ~INODE_INLINE;
+    unsigned int *block_map = fd_table[fileID].block_map;
+    memset(block_map, 0, num_blocks * sizeof(unsigned int));
+    if (num_blocks > 0) {
+        if (allocate_blocks_for_file(inode_no, block_map, 0, num_blocks - 1) == -1) {
+            inode->flags |= INODE_INLINE;
+            memcpy(inode->inline_data, data, inode->size);
+            free(data);
+            return -1;
+        }
+        write_whole_blocks(block_map, 0, num_blocks - 1, data);
+    }
+    fd_table[fileID].map_len = num_blocks;
+    mark_inode_dirty(inode_no);
+    free(data);
+    return 0;
+}
+
+/**
+ * Writes length bytes of buf into the file at index fileID of the file descriptor table, starting at
+ * byte offset of the file. Doesn't touch the file's rwpointer.
+ * This could increase the size of the file. offset may be past the end of the file, in which case the blocks
+ * between the old end and the write are left as holes, which read as zeros.
  * Returns the number of bytes written
+ * The caller must hold the file's inode lock exclusively, inside a journal_begin/journal_end pair
  */
-int sfs_fwrite(int fileID, const char *buf, int length){
+int write_file(int fileID, const char *buf, int length, int64_t offset){
 
     // Basic steps:
     // Get range of blocks that you wish to write. Allocate some if need be. Any allocated blocks do not need to be
     // read into memory as they are fresh and there is nothing in them to read
-    // Read these blocks into an array
-    // Overwrite relevant part of the array
-    // Write the blocks back to memory
+    // Patch the partial blocks at either end, and write the whole blocks in between straight from buf
     // Update data structures in memory and write them back to disk
 
     printf("Length of write: %d bytes\n", length);
@@ -799,101 +2221,568 @@ int sfs_fwrite(int fileID, const char *buf, int length){
         printf("Char %d of write: %c\n", i, *(buf + i));
     }*/
 
-    int rwptr = fd_table[fileID].rwptr;
+    if (length <= 0) {
+        return 0;
+    }
+
+    int64_t rwptr = offset;
     int inode_no = fd_table[fileID].inode_no;
+    if (rwptr + length > MAX_FILE_SIZE) {
+        printf("Error: The write would make the file too big.\n");
+        return -1;
+    }
+
+    // A small file's data stays in its inode until a write takes it past INODE_INLINE_DATA_SIZE bytes
+    if (inode_table[inode_no].flags & INODE_INLINE) {
+        if (rwptr + length <= INODE_INLINE_DATA_SIZE) {
+            return write_inline_data(inode_no, buf, length, rwptr);
+        }
+        if (move_inline_data_to_blocks(fileID) == -1) {
+            return -1;
+        }
+    }
 
     // Flags that will be used later
     int extending_file = (rwptr + length > inode_table[inode_no].size);
     int added_blocks = 0;
 
     int first_block = get_sequential_block_number_containing_byte(rwptr);
-    int last_block = get_sequential_block_number_containing_byte(rwptr + length); // Checked
+    int last_block = get_sequential_block_number_containing_byte(rwptr + length - 1);
     printf("First block for write: %d\n", first_block);
     printf("Last block for write: %d\n", last_block);
 
-    // Allocate a buffer to contain the data for all the blocks we need to read from disk
-    char temp_buf[(last_block - first_block + 1)*BLOCK_SZ];
-
-    // Iterate, reading one block at a time, and writing it to temp_buf
-    for (int i = first_block; i <= last_block; i++) {
-        if (file_has_nth_block(inode_no, i)) {
-            printf("File already has block %d, reading block\n", i);
-            int block_no = get_block_number_corresponding_to_nth_block_for_file(inode_no, i);
-            if (block_no == -1) {
-                return -1; // error
-            }
-            read_blocks(block_no, 1, temp_buf + (first_block == 0 ? i : (i % first_block)) * BLOCK_SZ);
-        } else {
-            printf("Allocating %dth block for file\n", i);
-            // Allocate a new block for the file
-            // No need to read it, as it doesn't yet contain any file data
-            int block_no = allocate_nth_block_for_file_with_inode(inode_no, i);
-            if (block_no == -1) {
-                return -1; // error
-            }
-            added_blocks = 1;
+    unsigned int *block_map = get_block_map_for_fd(fileID);
+    if (block_map == NULL) {
+        return -1;
+    }
+    int num_blocks = fd_table[fileID].map_len;
+    if (last_block >= num_blocks) {
+        // Blocks between the old end of the file and the write are left as holes
+        if (grow_block_map(fileID, last_block + 1) == -1) {
+            return -1;
+        }
+        block_map = fd_table[fileID].block_map;
+        memset(block_map + num_blocks, 0, (last_block + 1 - num_blocks) * sizeof(unsigned int));
+    }
+    // Blocks that are holes, including the ones past the old end of the file, get blocks now
+    int head_was_hole = (block_map[first_block] == 0);
+    int tail_was_hole = (block_map[last_block] == 0);
+    for (int i = first_block; i <= last_block && !added_blocks; i++) {
+        added_blocks = (block_map[i] == 0);
+    }
+    if (added_blocks) {
+        printf("Allocating blocks for holes in blocks %d to %d of file\n", first_block, last_block);
+        if (allocate_blocks_for_file(inode_no, block_map, first_block, last_block) == -1) {
+            return -1; // error
         }
     }
-    // Overwrite part of this block of data by writing length bytes of buf to temp_buf
-    // starting at block_data + (rwptr % BLOCK_SZ)
-    memcpy(temp_buf + (rwptr % BLOCK_SZ), buf, length);
+    if (last_block >= num_blocks) {
+        fd_table[fileID].map_len = last_block + 1;
+    }
+
+    // Blocks the write covers partially (at most the first and the last) are patched in place in the cache.
+    // Blocks that were holes don't need to be read, as they don't contain any file data.
+    // Whole blocks go straight from buf into the cache
+    int head = rwptr % BLOCK_SZ;            // Bytes of the first block before the write starts
+    int tail = (rwptr + length) % BLOCK_SZ; // Bytes of the last block the write covers, or 0 if it covers all of it
+    int whole_first = first_block;
+    int whole_last = last_block;
+    if (head != 0 || (first_block == last_block && tail != 0)) {
+        int n = (BLOCK_SZ - head < length) ? BLOCK_SZ - head : length;
+        cached_write_bytes(block_map[first_block], head, n, buf, head_was_hole);
+        whole_first++;
+    }
+    if (tail != 0 && last_block >= whole_first) {
+        cached_write_bytes(block_map[last_block], 0, tail, buf + length - tail, tail_was_hole);
+        whole_last--;
+    }
+    if (whole_first <= whole_last) {
+        int skip = (whole_first > first_block) ? BLOCK_SZ - head : 0;
+        write_whole_blocks(block_map, whole_first, whole_last, buf + skip);
+    }
 
     // Have to increase file size before we can seek to the end of the file
-    // We also have to increase the file size prior to calling get_block_number_corresponding_to_nth_block_for_file
     if (extending_file) {
         printf("Extending file, so updating file size\n");
-        // Update the file size, and write the inode table back to disk
+        // Update the file size. The inode's block of the inode table is journaled, along with the blocks of
+        // the free bit map that allocation touched, if any, now that the data is written
         inode_table[inode_no].size = rwptr + length;
-        flush_inode_table();
+    }
+    if (added_blocks) {
+        printf("Write required allocation of additional blocks, so journaling free bit map\n");
+    }
+
+    if (extending_file || added_blocks) {
+        mark_inode_dirty(inode_no);
+        journal_metadata_changes();
+    }
+
+    return length;
+}
+
+/**
+ * Writes the appends in the append buffer of the file at index fileID of the fd table to the file's blocks,
+ * allocating the blocks they need in one go, so they come out contiguous on disk where there is room
+ * Returns 0 on success and -1 if error (e.g. the disk is full), in which case the appends are kept in the buffer
+ * The caller must hold the file's inode lock exclusively, inside a journal_begin/journal_end pair
+ */
+int flush_append_buffer(int fileID) {
+    int len = fd_table[fileID].append_len;
+    if (len == 0) {
+        return 0;
+    }
+    int64_t offset = inode_table[fd_table[fileID].inode_no].size;
+    if (write_file(fileID, fd_table[fileID].append_buf, len, offset) != len) {
+        // The appends stay buffered, as the caller was told they were written
+        return -1;
+    }
+    fd_table[fileID].append_len = 0;
+    return 0;
+}
+
+/**
+ * Like write_file, but a write that starts at the end of the file or in its last appends (i.e. an append, or a
+ * rewrite of recent appends) goes into the file's append buffer instead, without allocating blocks or changing
+ * the inode. The buffer is written out by flush_append_buffer when the next write doesn't fit in it, and by
+ * sfs_fflush, sfs_fclose and sfs_sync. A run of small appends then costs one allocation and one metadata
+ * change per APPEND_BUFFER_BLOCKS blocks, rather than one per append.
+ * Returns the number of bytes written, or -1 if error
+ * The caller must hold the file's inode lock exclusively, inside a journal_begin/journal_end pair
+ */
+int write_file_buffered(int fileID, const char *buf, int length, int64_t offset) {
+    file_descriptor_t *f = &fd_table[fileID];
+    int capacity = APPEND_BUFFER_BLOCKS * BLOCK_SZ;
+    if (length <= 0) {
+        return 0;
+    }
+    int64_t start = offset - (int64_t) inode_table[f->inode_no].size;  // Where the write starts in the append buffer
+    // Writes that start past the end of the buffered appends go to write_file, which leaves a hole before them
+    int fits = (start >= 0 && start <= f->append_len && start + length <= capacity);
+    if (!fits && offset + length > (int64_t) inode_table[f->inode_no].size) {
+        // The write doesn't fit in the buffer, but reaches past the end of the file's blocks
+        if (flush_append_buffer(fileID) == -1) {
+            return -1;
+        }
+        start = offset - (int64_t) inode_table[f->inode_no].size;
+        fits = (start == 0 && length <= capacity);
+    }
+    if (!fits) {
+        return write_file(fileID, buf, length, offset);
+    }
+    if (f->append_buf == NULL && (f->append_buf = malloc(capacity)) == NULL) {
+        printf("Error: Could not allocate an append buffer.\n");
+        return write_file(fileID, buf, length, offset);
+    }
+    memcpy(f->append_buf + start, buf, length);
+    if (start + length > f->append_len) {
+        f->append_len = start + length;
+    }
+    return length;
+}
+
+/**
+ * Writes length bytes of buf into the file at index fileID of
+ * the file descriptor table, starting at the byte of the current rwpointer
+ * as determined from the file descriptor table.
+ * This could increase the size of the file.
+ * Returns the number of bytes written
+ */
+int sfs_fwrite(int fileID, const char *buf, int length){
+    if (!is_open_fd(fileID)) {
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    journal_begin();
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int64_t rwptr = fd_table[fileID].rwptr;
+    int result = write_file_buffered(fileID, buf, length, rwptr);
+    if (result > 0) {
+        // Update the rwpointer for the file
+        printf("Seeking to end of file as we've completed a write\n");
+        seek_file(fileID, rwptr + result - 1);
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    journal_end();
+    return result;
+}
+
+/**
+ * Writes length bytes of buf into the file at index fileID of the file descriptor table, starting at byte
+ * offset of the file, without using or moving the file's rwpointer. offset may be the size of the file,
+ * to append, or past it, which leaves a hole between the old end of the file and the write.
+ * Returns the number of bytes written, or -1 if error
+ */
+int sfs_pwrite(int fileID, const char *buf, int length, int64_t offset) {
+    if (!is_open_fd(fileID)) {
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    journal_begin();
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int result;
+    if (offset < 0) {
+        printf("Error: Attempting to write before the start of a file.\n");
+        result = -1;
+    } else {
+        result = write_file_buffered(fileID, buf, length, offset);
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    journal_end();
+    return result;
+}
 
-        // Flush the free bit map if need be
-        if (added_blocks) {
-            printf("Write required allocation of additional blocks, so flushing free bit map\n");
-            flush_free_bit_map();
+/**
+ * Adds up the lengths of the iovcnt buffers of iov
+ * Returns the total, or -1 if it doesn't fit in an int, the way the lengths of sfs_fread and sfs_fwrite have to
+ */
+int iovec_length(const struct iovec *iov, int iovcnt) {
+    if (iovcnt < 0) {
+        printf("Error: Negative number of buffers.\n");
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t) INT_MAX - total) {
+            printf("Error: Buffers add up to more than %d bytes.\n", INT_MAX);
+            return -1;
         }
+        total += iov[i].iov_len;
     }
+    return (int) total;
+}
 
-    // Write the blocks back to disk!
-    for (int i = first_block; i <= last_block; i++) {
-        printf("Writing block %d for file back to disk\n", i);
-        // Could have stored the block numbers in an array or something, but since we are not worried
-        // about the most efficient implementation, I don't bother
-        int block_no = get_block_number_corresponding_to_nth_block_for_file(inode_no, i);
-        write_blocks(block_no, 1, temp_buf + (first_block == 0 ? i : (i % first_block)) * BLOCK_SZ);
-        printf("Wrote block %d for file back to disk\n", i);
+/**
+ * Reads from the file at index fileID of the file descriptor table into the iovcnt buffers of iov, filling each
+ * before moving on to the next, starting at byte offset of the file. Doesn't touch the file's rwpointer.
+ * Returns the number of bytes read, which is less than the buffers hold if the file ends first, or -1 if error
+ * The caller must hold the file's inode lock, shared or exclusive
+ */
+int readv_file(int fileID, const struct iovec *iov, int iovcnt, int64_t offset) {
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int result = read_file(fileID, iov[i].iov_base, (int) iov[i].iov_len, offset + total);
+        if (result < 0) {
+            return (total > 0) ? total : -1;
+        }
+        total += result;
+        if (result < (int) iov[i].iov_len) {
+            // The file ended
+            break;
+        }
     }
+    return total;
+}
 
-    // Update the rwpointer for the file
-    printf("Seeking to end of file as we've completed a write\n");
-    sfs_fseek(fileID, rwptr + length - 1);
+/**
+ * Writes the iovcnt buffers of iov one after the other into the file at index fileID of the file descriptor table,
+ * starting at byte offset of the file, through write_file_buffered, so that small buffers are gathered in the
+ * file's append buffer rather than each being written on its own. Doesn't touch the file's rwpointer.
+ * Returns the number of bytes written, or -1 if error
+ * The caller must hold the file's inode lock exclusively, inside a journal_begin/journal_end pair
+ */
+int writev_file(int fileID, const struct iovec *iov, int iovcnt, int64_t offset) {
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int result = write_file_buffered(fileID, iov[i].iov_base, (int) iov[i].iov_len, offset + total);
+        if (result < 0) {
+            return (total > 0) ? total : -1;
+        }
+        total += result;
+    }
+    return total;
+}
 
-    return length;
+/**
+ * Reads from the file at index fileID of the file descriptor table into the iovcnt buffers of iov, starting at the
+ * byte of the current rwpointer. It is the same as one sfs_fread of all the bytes into a single buffer, without
+ * the caller having to copy them out of it.
+ * Returns the number of bytes read, which is less than the buffers hold if the file ends first, or -1 if error
+ */
+int sfs_readv(int fileID, const struct iovec *iov, int iovcnt) {
+    if (!is_open_fd(fileID) || iovec_length(iov, iovcnt) == -1) {
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int64_t rwptr = fd_table[fileID].rwptr;
+    int result = readv_file(fileID, iov, iovcnt, rwptr);
+    if (result > 0) {
+        seek_file(fileID, rwptr + result - 1);
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    return result;
 }
 
 /**
- * Move the rwpointer for the file corresponding to fd entry fileID
- * to loc. i.e. change the rwptr property of the file_descriptor_t struct
- * at index fileID of the file descriptor table to loc.
- * Returns 0 if success and -1 if error (i.e. trying to move the rwpointer
- * outside of the bounds of the file)
+ * Writes the iovcnt buffers of iov one after the other into the file at index fileID of the file descriptor table,
+ * starting at the byte of the current rwpointer. It is the same as one sfs_fwrite of the buffers joined together:
+ * the inode lock is taken and the journal operation counted once for all of them, so a record made of many
+ * fragments costs what one sfs_fwrite of it does.
+ * Returns the number of bytes written, or -1 if error
+ */
+int sfs_writev(int fileID, const struct iovec *iov, int iovcnt) {
+    if (!is_open_fd(fileID) || iovec_length(iov, iovcnt) == -1) {
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    journal_begin();
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int64_t rwptr = fd_table[fileID].rwptr;
+    int result = writev_file(fileID, iov, iovcnt, rwptr);
+    if (result > 0) {
+        printf("Seeking to end of file as we've completed a write\n");
+        seek_file(fileID, rwptr + result - 1);
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    journal_end();
+    return result;
+}
+
+/**
+ * Like sfs_readv, but starting at byte offset of the file, without using or moving the file's rwpointer
+ * Returns the number of bytes read (0 at or past the end of the file), or -1 if error
  */
-int sfs_fseek(int fileID, int loc){
+int sfs_preadv(int fileID, const struct iovec *iov, int iovcnt, int64_t offset) {
+    if (!is_open_fd(fileID) || iovec_length(iov, iovcnt) == -1) {
+        return -1;
+    }
+    if (offset < 0) {
+        printf("Error: Attempting to read before the start of a file.\n");
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    pthread_rwlock_rdlock(&inode_locks[inode_no]);
+    int result = readv_file(fileID, iov, iovcnt, offset);
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    return result;
+}
 
-    /* Perform error checking:
-     * If loc > size, we are moving the pointer past the end of the file. This
-     * is not allowed.
-     * If loc is negative, this, of course, is not allowed
-     */
-    if (loc >= inode_table[fd_table[fileID].inode_no].size) {
-        printf("Error: Attempting to seek past the end of a file.\n");
+/**
+ * Like sfs_writev, but starting at byte offset of the file, without using or moving the file's rwpointer.
+ * offset may be the size of the file, to append, or past it, which leaves a hole before the write.
+ * Returns the number of bytes written, or -1 if error
+ */
+int sfs_pwritev(int fileID, const struct iovec *iov, int iovcnt, int64_t offset) {
+    if (!is_open_fd(fileID) || iovec_length(iov, iovcnt) == -1) {
         return -1;
-    } else if (loc < 0) {
-        printf("Error: Attempting to seek before the start of a file.\n");
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    journal_begin();
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int result;
+    if (offset < 0) {
+        printf("Error: Attempting to write before the start of a file.\n");
+        result = -1;
+    } else {
+        result = writev_file(fileID, iov, iovcnt, offset);
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    journal_end();
+    return result;
+}
+
+/**
+ * Gives the appends buffered for the file at index fileID of the fd table their blocks, so that they are
+ * in the block cache and the file's inode, and reach the disk with the next sfs_sync
+ * Returns 0 on success and -1 if error
+ */
+int sfs_fflush(int fileID) {
+    if (!is_open_fd(fileID)) {
         return -1;
     }
-    fd_table[fileID].rwptr = loc;
-    printf("Seeked to byte %d\n", loc);
-	  return 0;
+    int inode_no = fd_table[fileID].inode_no;
+    journal_begin();
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int result = flush_append_buffer(fileID);
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    journal_end();
+    return result;
+}
+
+/**
+ * Closes a file. All this involves is resetting the entry at index fileID
+ * from the file descriptor table
+ * Returns 0 on success and -1 number otherwise. If the file's buffered appends can't be written (the disk is
+ * full), the file stays open with them still buffered
+ */
+int sfs_fclose(int fileID){
+    journal_begin();
+    pthread_mutex_lock(&directory_lock);
+    if (!is_open_fd(fileID)) {
+        pthread_mutex_unlock(&directory_lock);
+        journal_end();
+        return -1;
+    }
+    // The fd is released under the inode lock, so that no write is using its append buffer while it is freed
+    int inode_no = fd_table[fileID].inode_no;
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    // Give buffered appends their blocks first
+    if (flush_append_buffer(fileID) == -1) {
+        pthread_rwlock_unlock(&inode_locks[inode_no]);
+        pthread_mutex_unlock(&directory_lock);
+        journal_end();
+        return -1;
+    }
+    remove_from_fd_table(fileID);
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    pthread_mutex_unlock(&directory_lock);
+    journal_end();
+    return 0;
+}
+
+/**
+ * Turns bytes offset to offset + length - 1 of the file at index fileID of the fd table into zeros without changing
+ * its size, the way fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE) does. Blocks that lie wholly in the range
+ * are freed and become holes, and indirect blocks left without any pointers are freed with them. Parts of blocks
+ * at either end of the range are zeroed in place.
+ * Returns 0 on success
+ * The caller must hold the file's inode lock exclusively, inside a journal_begin/journal_end pair, and the file's
+ * append buffer must be empty
+ */
+int punch_hole(int fileID, int64_t offset, int64_t length) {
+    int inode_no = fd_table[fileID].inode_no;
+    int64_t size = inode_table[inode_no].size;
+    if (offset >= size || length <= 0) {
+        return 0;
+    }
+    if (length > size - offset) {
+        length = size - offset;
+    }
+    if (inode_table[inode_no].flags & INODE_INLINE) {
+        memset(inode_table[inode_no].inline_data + offset, 0, length);
+        mark_inode_dirty(inode_no);
+        journal_metadata_changes();
+        return 0;
+    }
+    unsigned int *block_map = get_block_map_for_fd(fileID);
+    char zeros[BLOCK_SZ];
+    memset(zeros, 0, BLOCK_SZ);
+
+    // Zero the parts of the blocks at either end that the range covers partially, unless they are holes already
+    int first_whole = (offset + BLOCK_SZ - 1) / BLOCK_SZ;
+    // A range that reaches the end of the file covers all of the file's last block
+    int last_whole = ((offset + length == size) ? offset + length + BLOCK_SZ - 1 : offset + length) / BLOCK_SZ - 1;
+    int first_block = offset / BLOCK_SZ;
+    int last_block = (offset + length - 1) / BLOCK_SZ;
+    if (first_block < first_whole || last_whole < first_block) {
+        int64_t block_end = (int64_t) (first_block + 1) * BLOCK_SZ;
+        int64_t end = (block_end < offset + length) ? block_end : offset + length;
+        if (block_map[first_block] != 0) {
+            cached_write_bytes(block_map[first_block], offset % BLOCK_SZ, end - offset, zeros, 0);
+        }
+    }
+    if (last_block > last_whole && last_block != first_block && block_map[last_block] != 0) {
+        cached_write_bytes(block_map[last_block], 0, (offset + length) - (int64_t) last_block * BLOCK_SZ, zeros, 0);
+    }
+    if (first_whole > last_whole) {
+        return 0;
+    }
+
+    // Free the whole blocks, and clear the pointers to them
+    for (int i = first_whole; i <= last_whole; i++) {
+        if (block_map[i] != 0) {
+            rm_index(block_map[i]);
+            block_map[i] = 0;
+            if (i < NUM_DIRECT_POINTERS) {
+                inode_table[inode_no].data_ptrs[i] = 0;
+            }
+        }
+    }
+    long long base = NUM_DIRECT_POINTERS;
+    for (int level = 1; level <= NUM_INDIRECT_LEVELS; level++) {
+        long long span = get_blocks_per_pointer(level + 1);
+        int first = ((first_whole > base) ? first_whole : base) - base;
+        int last = ((last_whole < base + span - 1) ? last_whole : base + span - 1) - base;
+        unsigned int *root = get_indirect_root(inode_no, level);
+        if (first <= last && *root != 0 && unlink_pointer_tree(*root, level, 0, first, last)) {
+            rm_index(*root);
+            *root = 0;
+        }
+        base += span;
+    }
+    mark_inode_dirty(inode_no);
+    journal_metadata_changes();
+    return 0;
+}
+
+/**
+ * Turns length bytes of the file at index fileID of the fd table, starting at byte offset, into a hole that reads
+ * as zeros, freeing the blocks that lie wholly inside it. The file's size doesn't change, and the part of the
+ * range past the end of the file is ignored.
+ * Returns 0 on success and -1 if error
+ */
+int sfs_punch_hole(int fileID, int64_t offset, int64_t length) {
+    if (!is_open_fd(fileID)) {
+        return -1;
+    }
+    if (offset < 0 || length < 0) {
+        printf("Error: Attempting to punch a hole outside of a file.\n");
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    journal_begin();
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int result = flush_append_buffer(fileID);
+    if (result == 0) {
+        result = punch_hole(fileID, offset, length);
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    journal_end();
+    return result;
+}
+
+/**
+ * Sets the size of the file at index fileID of the fd table to length bytes, the way ftruncate does. A file that
+ * shrinks has the blocks past its new end freed, along with any indirect blocks left empty, and the rest of its
+ * last block zeroed, so none of the old data comes back if it grows again. A file that grows reads as zeros past
+ * its old end, which is left as a hole. The file's rwpointer is left where it is.
+ * Returns 0 on success and -1 if error
+ */
+int sfs_ftruncate(int fileID, int64_t length) {
+    if (!is_open_fd(fileID)) {
+        return -1;
+    }
+    if (length < 0 || length > MAX_FILE_SIZE) {
+        printf("Error: Attempting to truncate a file to a size it can't have.\n");
+        return -1;
+    }
+    int inode_no = fd_table[fileID].inode_no;
+    journal_begin();
+    pthread_rwlock_wrlock(&inode_locks[inode_no]);
+    int num_blocks = get_number_of_blocks_for_size(length);
+    // The block map gets room for the new size up front, so nothing changes if there is no memory for it
+    int result = grow_block_map(fileID, (num_blocks > 0) ? num_blocks : 1);
+    if (result == 0) {
+        result = flush_append_buffer(fileID);
+    }
+    int64_t size = inode_table[inode_no].size;
+    if (result == 0 && length < size) {
+        result = punch_hole(fileID, length, size - length);
+    }
+    // A file whose data is in its inode only keeps it there while it fits
+    if (result == 0 && length > INODE_INLINE_DATA_SIZE && (inode_table[inode_no].flags & INODE_INLINE)) {
+        result = move_inline_data_to_blocks(fileID);
+    }
+    if (result == 0 && length > size && (inode_table[inode_no].flags & INODE_INLINE)) {
+        memset(inode_table[inode_no].inline_data + size, 0, length - size);
+    }
+    if (result == 0 && length != size) {
+        inode_table[inode_no].size = length;
+        // The block map stays resolved, as readers sharing the inode lock use it. The blocks punch_hole freed are
+        // already 0 in it, and blocks past the old end are holes
+        if (!(inode_table[inode_no].flags & INODE_INLINE)) {
+            if (num_blocks > fd_table[fileID].map_len) {
+                memset(fd_table[fileID].block_map + fd_table[fileID].map_len, 0,
+                       (num_blocks - fd_table[fileID].map_len) * sizeof(unsigned int));
+            }
+            fd_table[fileID].map_len = num_blocks;
+        }
+        mark_inode_dirty(inode_no);
+        journal_metadata_changes();
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_no]);
+    journal_end();
+    return result;
 }
 
 /**
@@ -901,8 +2790,10 @@ int sfs_fseek(int fileID, int loc){
  * releases the file allocation table entries, and releases the data
  * blocks used by the file
  * Returns -1 if error and 0 if success
+ * remove_file does the work; the caller must hold directory_lock inside a journal_begin/journal_end pair.
+ * The file's inode lock isn't needed: the file is closed, and can't be opened while directory_lock is held
  */
-int sfs_remove(char *file) {
+int remove_file(char *file) {
     // Search the directory for the file name
     int dir_index = get_directory_index_for_file_with_name(file);
     if (dir_index == -1) {
@@ -932,47 +2823,252 @@ int sfs_remove(char *file) {
     printf("Resetting the inode table entry\n");
     reset_inode_table_entry(inode_no);
 
-    // We modified the directory table, the free block map, and the inode table
-    printf("Flushing all to disk\n");
-    flush_all();
+    // We modified the directory table, the free block map, and the inode table. The blocks holding
+    // the entries we touched go to the journal
+    printf("Journaling changed metadata\n");
+    journal_metadata_changes();
     printf("Successfully removed file\n");
     return 0;
 }
 
+int sfs_remove(char *file) {
+    journal_begin();
+    pthread_mutex_lock(&directory_lock);
+    int result = remove_file(file);
+    pthread_mutex_unlock(&directory_lock);
+    journal_end();
+    return result;
+}
+
+
+/**
+ * Commits any metadata changes to the journal, writes every dirty block held in the block cache to disk,
+ * in block-number order, and asks the disk emulator to make the writes durable
+ * Returns 0 on success and -1 if error
+ */
+int sfs_sync() {
+    // Give every open file's buffered appends their blocks, so they are part of what is synced
+    int result = 0;
+    journal_begin();
+    pthread_mutex_lock(&directory_lock);
+    for (int fd = 0; fd < FD_TABLE_SIZE; fd++) {
+        if (fd_table[fd].inode_no != 0 && fd_table[fd].append_len != 0) {
+            pthread_rwlock_wrlock(&inode_locks[fd_table[fd].inode_no]);
+            if (flush_append_buffer(fd) == -1) {
+                result = -1;
+            }
+            pthread_rwlock_unlock(&inode_locks[fd_table[fd].inode_no]);
+        }
+    }
+    pthread_mutex_unlock(&directory_lock);
+    journal_end();
+    if (result == -1 || commit_journal() == -1 || flush_block_cache() == -1 || sync_disk() == -1) {
+        printf("Error: Could not sync the file system to disk\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes the writes made so far to the open file at index fileID of the fd table durable, as far as the durability
+ * mode allows: its buffered appends get their blocks, the journal is committed and the block cache is written back.
+ * Other files' blocks in the cache are written back too, as the cache doesn't know which file a block belongs to.
+ * Returns 0 on success and -1 if error
+ */
+int sfs_fsync(int fileID) {
+    if (sfs_fflush(fileID) == -1) {
+        return -1;
+    }
+    if (commit_journal() == -1 || flush_block_cache() == -1 || sync_disk() == -1) {
+        printf("Error: Could not sync the file to disk\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets how durable disk writes are made, from the next time a file system is made or opened with mksfs:
+ * DISK_DURABILITY_NONE never forces them to stable storage, DISK_DURABILITY_ON_SYNC forces them at every
+ * sfs_sync, sfs_fsync and journal commit, and DISK_DURABILITY_EVERY_WRITE makes each disk write durable as it is made
+ */
+void sfs_set_durability(int mode) {
+    durability_mode = mode;
+}
+
+/**
+ * Sets whether files created from now on keep their data in their inode while it fits in INODE_INLINE_DATA_SIZE
+ * bytes, rather than in blocks. It's on by default. Files that already exist stay as they are
+ */
+void sfs_set_inline_data(int on) {
+    inline_data_on = on;
+}
 
 /***************************
  * MARK -  Bitmap helpers
  ***************************/
 
 /**
- * Sets a specific bit as used
+ * Sets a specific bit as used. The caller must hold allocator_lock
  * index is the number of the bit that we wish to set as used
  */
-void force_set_index(unsigned int index) {
+void use_index(unsigned int index) {
     int i = index / 8; // i is the index of the entry of the free_bit_map we wish to change
     int which_bit = index % 8;
     USE_BIT(free_bit_map[i], which_bit);
+    mark_bit_map_dirty(index);
+}
+
+/**
+ * Sets a specific bit as used
+ * index is the number of the bit that we wish to set as used
+ */
+void force_set_index(unsigned int index) {
+    pthread_mutex_lock(&allocator_lock);
+    use_index(index);
+    pthread_mutex_unlock(&allocator_lock);
 }
 
 /**
- * Gets the number of the first available free bit in the bitmap
+ * Returns 1 if the bit with number "index" is free, and 0 if it is used
  */
-unsigned int get_index() {
-    unsigned int i = 0;
+int is_index_free(unsigned int index) {
+    return (free_bit_map[index / 8] >> (index % 8)) & 1;
+}
 
-    // find the first section with a free bit
-    // let's ignore overflow for now...
-    while (free_bit_map[i] == 0) { i++; }
+/**
+ * Returns the nth 64-bit word of the bitmap. Bit k of the word is the bit with number n*64 + k
+ */
+uint64_t get_bit_map_word(unsigned int n) {
+    uint64_t word;
+    memcpy(&word, free_bit_map + n * 8, sizeof(word));
+    return le64toh(word);
+}
 
-    // now, find the first free bit
-    // ffs has the lsb as 1, not 0. So we need to subtract
-    uint8_t bit = ffs(free_bit_map[i]) - 1;
+/**
+ * Returns the number of the first free bit at or after "from", or -1 if there is none.
+ * The bitmap is scanned 64 bits at a time; only the bytes past the last whole word are scanned bytewise
+ */
+int find_free_index_from(unsigned int from) {
+    unsigned int i = from;
+    while (i < NUM_BIT_MAP_BITS) {
+        if (i / 64 < NUM_BIT_MAP_WORDS) {
+            uint64_t word = get_bit_map_word(i / 64) >> (i % 64);
+            if (word != 0) {
+                return i + __builtin_ctzll(word);
+            }
+            i = (i / 64 + 1) * 64;
+        } else {
+            uint8_t byte = free_bit_map[i / 8] >> (i % 8);
+            if (byte != 0) {
+                // ffs has the lsb as 1, not 0. So we need to subtract
+                return i + ffs(byte) - 1;
+            }
+            i = (i / 8 + 1) * 8;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns how many consecutive free bits there are starting at "start", counting no further than max
+ */
+int count_free_run(unsigned int start, int max) {
+    int n = 0;
+    while (n < max && start + n < NUM_BIT_MAP_BITS) {
+        unsigned int i = start + n;
+        if (i % 64 == 0 && i / 64 < NUM_BIT_MAP_WORDS) {
+            // Whole word at a time: the run goes on for as many low bits of the word as are set
+            uint64_t word = get_bit_map_word(i / 64);
+            if (word == UINT64_MAX) {
+                n += 64;
+                continue;
+            }
+            n += __builtin_ctzll(~word);
+            break;
+        }
+        if (!is_index_free(i)) {
+            break;
+        }
+        n++;
+    }
+    return (n < max) ? n : max;
+}
+
+/**
+ * Gets the number of the next available free bit in the bitmap, and sets it as used.
+ * The search starts at next_free_bit_hint (just past the last bit handed out) and wraps around once,
+ * so successive allocations don't rescan the used blocks at the start of the disk
+ * Returns -1 if the disk is full
+ */
+int get_index() {
+    pthread_mutex_lock(&allocator_lock);
+    int i = find_free_index_from(next_free_bit_hint);
+    if (i == -1) {
+        i = find_free_index_from(0);
+    }
+    if (i == -1) {
+        printf("Error: The disk is full.\n");
+        pthread_mutex_unlock(&allocator_lock);
+        return -1;
+    }
 
     // set the bit to used
-    USE_BIT(free_bit_map[i], bit);
+    use_index(i);
+    next_free_bit_hint = i + 1;
+    pthread_mutex_unlock(&allocator_lock);
 
     //return which bit we used
-    return i*8 + bit;
+    return i;
+}
+
+/**
+ * Gets a run of up to want contiguous free blocks and sets them as used. If goal is free the run
+ * starts there, which lets a growing file continue where it left off. Otherwise the run starts at
+ * the first free run of want blocks found from next_free_bit_hint onwards (wrapping around once),
+ * or failing that at the first free block found.
+ * len is set to the length of the run (0 if the disk is full), and the number of its first block is returned
+ */
+unsigned int get_index_run(unsigned int goal, int want, int *len) {
+    int start = -1;
+    pthread_mutex_lock(&allocator_lock);
+    if (goal < NUM_BIT_MAP_BITS && is_index_free(goal)) {
+        start = goal;
+    } else {
+        int first_free = -1;
+        for (int pass = 0; pass < 2 && start == -1; pass++) {
+            unsigned int from = (pass == 0) ? next_free_bit_hint : 0;
+            unsigned int end = (pass == 0) ? NUM_BIT_MAP_BITS : next_free_bit_hint;
+            int i;
+            while ((i = find_free_index_from(from)) != -1 && (unsigned int) i < end) {
+                if (first_free == -1) {
+                    first_free = i;
+                }
+                int run = count_free_run(i, want);
+                if (run == want) {
+                    start = i;
+                    break;
+                }
+                from = i + run;
+            }
+        }
+        if (start == -1) {
+            start = first_free;
+        }
+    }
+
+    *len = 0;
+    if (start == -1) {
+        pthread_mutex_unlock(&allocator_lock);
+        return 0;
+    }
+    // Take as many free blocks from start as we can, up to want
+    *len = count_free_run(start, want);
+    for (int i = 0; i < *len; i++) {
+        use_index(start + i);
+    }
+    next_free_bit_hint = start + *len;
+    pthread_mutex_unlock(&allocator_lock);
+    return start;
 }
 
 /**
@@ -987,5 +3083,8 @@ void rm_index(unsigned int index) {
     uint8_t bit = index % 8;
 
     // free bit
+    pthread_mutex_lock(&allocator_lock);
     FREE_BIT(free_bit_map[i], bit);
+    mark_bit_map_dirty(index);
+    pthread_mutex_unlock(&allocator_lock);
 }
@@ -2,17 +2,39 @@
 #define _INCLUDE_SFS_API_H_
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #define MAXFILENAME 30
 #define KEITHS_DISK "sfs_disk.disk"
-#define BLOCK_SZ 1024   // Block size in bytes
-#define NUM_BLOCKS 3100  // Number of blocks of the entire disk
-#define NUM_INODES 110   // Number of inodes in the inode table
+#define KEITHS_DISK_BACKEND DISK_BACKEND_STDIO   // Which disk_emu backend to use: DISK_BACKEND_STDIO, or DISK_BACKEND_MMAP to opt in to the mapping
+#define KEITHS_ASYNC_ENGINE DISK_ASYNC_URING   // Which engine disk_emu's asynchronous interface uses: DISK_ASYNC_URING, DISK_ASYNC_THREADS or DISK_ASYNC_NONE
+#define KEITHS_DISK_DURABILITY DISK_DURABILITY_ON_SYNC   // How durable disk writes are made by default, see sfs_set_durability
+#define ASYNC_QUEUE_DEPTH 32    // Most disk requests the block cache has in flight at once
+#define DEFAULT_BLOCK_SZ 1024   // Block size in bytes of a file system made by mksfs
+#define DEFAULT_NUM_BLOCKS 3100  // Number of blocks of the entire disk, for mksfs
+#define DEFAULT_NUM_INODES 110   // Number of inodes in the inode table, for mksfs
+#define MIN_BLOCK_SZ 128  // Smallest block size mksfs_with_geometry accepts. Block sizes must be powers of 2
+#define BLOCK_SZ (geometry.block_size)  // The geometry of the file system that is open, see geometry_t
+#define NUM_BLOCKS (geometry.num_blocks)
+#define NUM_INODES (geometry.num_inodes)
+#define CACHE_CAPACITY 512  // Number of blocks kept in the write-back block cache
+#define JOURNAL_BLOCKS 64   // Number of blocks reserved for the metadata journal, including its header block
+#define JOURNAL_GROUP_OPS 8 // Number of metadata-changing operations committed to the journal together
+#define READAHEAD_MIN_BLOCKS 4   // Readahead window, in blocks, when a file starts being read sequentially
+#define READAHEAD_MAX_BLOCKS 64  // Largest the readahead window grows to
+#define APPEND_BUFFER_BLOCKS 16  // Size, in blocks, of the buffer that holds an open file's appends until they get blocks
 #define NUM_INDIRECT_POINTERS (BLOCK_SZ/sizeof(int))
 #define NUM_DIRECT_POINTERS 12
-#define MAX_BLOCKS_PER_FILE (NUM_DIRECT_POINTERS + NUM_INDIRECT_POINTERS)
-#define MAX_FILE_SIZE (BLOCK_SZ * MAX_BLOCKS_PER_FILE) // Max file size in bytes
-#define NUM_INODE_BLOCKS (sizeof(inode_t) * NUM_INODES / BLOCK_SZ + 1) // Number of blocks needed to store the inode table, +1 to give ceiling, rather than floor
+#define NUM_INDIRECT_LEVELS 3  // An inode has a single, a double and a triple indirect pointer
+#define INODE_SIZE 512  // Size in bytes of an inode in the inode table
+#define INODE_INLINE_DATA_SIZE (INODE_SIZE - 16)  // Largest file kept in its inode rather than in blocks: all but size, is_used and flags
+#define INODE_INLINE 0x1  // Flag of an inode whose file's data is in its inline_data
+#define MAX_POINTED_BLOCKS ((long long) NUM_DIRECT_POINTERS + NUM_INDIRECT_POINTERS + NUM_INDIRECT_POINTERS * NUM_INDIRECT_POINTERS \
+                            + NUM_INDIRECT_POINTERS * NUM_INDIRECT_POINTERS * NUM_INDIRECT_POINTERS) // Blocks the pointers can address
+#define MAX_BLOCKS_PER_FILE ((MAX_POINTED_BLOCKS < INT32_MAX) ? MAX_POINTED_BLOCKS : INT32_MAX) // Blocks of a file are numbered with ints
+#define MAX_FILE_SIZE ((int64_t) BLOCK_SZ * MAX_BLOCKS_PER_FILE) // Max file size in bytes
+#define INODE_TABLE_SIZE_IN_BYTES (sizeof(inode_t) * NUM_INODES)
+#define NUM_INODE_BLOCKS (INODE_TABLE_SIZE_IN_BYTES / BLOCK_SZ + 1) // Number of blocks needed to store the inode table, +1 to give ceiling, rather than floor
 #define MAX_DIRECTORY_ENTRIES (NUM_INODES - 1)  // Maximum number directory entries in the directory table. We can only have as
                                               // many files as we have available inodes - 1, as the first inode is always for
                                               // the root directory
@@ -21,28 +43,95 @@
 #define FD_TABLE_SIZE (NUM_INODES - 1)
 
 
+/**
+ * The block size, disk size and number of inodes of the file system that is open. They come from its superblock,
+ * or from mksfs_with_geometry when it is made, and the in-memory tables are sized from them.
+ * Until a file system is made or opened they hold the defaults
+ */
+typedef struct {
+    int block_size;
+    int num_blocks;
+    int num_inodes;
+} geometry_t;
+
+extern geometry_t geometry;
+
 typedef struct {
     unsigned int magic;
     unsigned int block_size;
-    unsigned int fs_size;
+    unsigned int fs_size;       // Size of the disk in bytes, modulo 2^32. num_blocks is the one to go by
     unsigned int inode_table_len;
     unsigned int root_dir_inode;
+    unsigned int journal_start; // First block of the journal (its header)
+    unsigned int journal_len;   // Number of blocks of the journal
+    unsigned int num_blocks;    // Number of blocks of the disk
+    unsigned int num_inodes;    // Number of inodes in the inode table
 } superblock_t;
 
+/**
+ * The metadata journal is a redo log: a header block followed by transactions, each of which is a descriptor
+ * block, the new contents of the metadata blocks it changed, and a commit block
+ */
+#define JOURNAL_HEADER_MAGIC 0x4A524E4C
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4A44534B
+#define JOURNAL_COMMIT_MAGIC 0x4A434D54
+#define JOURNAL_MAX_TRANSACTION_BLOCKS (BLOCK_SZ / sizeof(unsigned int) - 3)
+
+typedef struct {
+    unsigned int magic;
+    unsigned int sequence;  // Sequence number of the first transaction in the log
+} journal_header_t;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned int count;     // Number of block images following the descriptor
+    unsigned int home_blocks[];  // Where each image belongs on disk. The rest of the block has room for
+                                 // JOURNAL_MAX_TRANSACTION_BLOCKS of them
+} journal_descriptor_t;
+
 typedef struct {
-    unsigned int size;      // Size of file, in bytes.
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned int checksum;  // Over the descriptor and the images, so a torn transaction is not replayed
+} journal_commit_t;
+
+typedef struct {
+    uint64_t size;          // Size of file, in bytes.
     unsigned int is_used;      // An addition - not normally in an inode but I add it to track whether the inode is used or not. If 1, used, if 0, free.
-    unsigned int data_ptrs[NUM_DIRECT_POINTERS]; // Direct pointers
-    unsigned int indirect_ptr;  // An indirect ptr. It's value is a the number of a block containing BLOCK_SZ/4 direct pointers
+    unsigned int flags;     // INODE_INLINE, or 0 for a file whose data is in blocks
+    union {
+        struct {
+            unsigned int data_ptrs[NUM_DIRECT_POINTERS]; // Direct pointers
+            unsigned int indirect_ptr;  // An indirect ptr. It's value is a the number of a block containing BLOCK_SZ/4 direct pointers
+            unsigned int double_indirect_ptr;  // The number of a block of BLOCK_SZ/4 pointers to blocks like the one indirect_ptr points to
+            unsigned int triple_indirect_ptr;  // The number of a block of BLOCK_SZ/4 pointers to blocks like the one double_indirect_ptr points to
+        };
+        char inline_data[INODE_INLINE_DATA_SIZE];  // With INODE_INLINE, the file's data, followed by zeros. The file has no blocks
+    };
 } inode_t;
 
 /*
- * inode    which inode this entry describes
- * rwptr    where in the file to start
+ * inode        which inode this entry describes
+ * rwptr        where in the file to start
+ * block_map    the file's block numbers in file order, resolved from the direct and indirect pointers
+ *              the first time they are needed and kept up to date as blocks are allocated. It is the file's
+ *              cache of its indirect blocks: once it is resolved, finding a block at any offset is an array lookup
+ * ra_*         readahead state, see do_readahead() in sfs_api.c
+ * append_*     appends that have not been given blocks yet, see write_file_buffered() in sfs_api.c
  */
 typedef struct {
     unsigned int inode_no; // The inode number
-    unsigned int rwptr; // The byte of the file the rwpointer is at
+    int64_t rwptr; // The byte of the file the rwpointer is at
+    int map_valid; // 1 if block_map holds the file's block numbers, 0 if they have not been resolved yet
+    int map_len; // Number of blocks the file has, i.e. number of entries of block_map in use
+    int map_cap; // Number of entries block_map has room for
+    unsigned int *block_map;
+    int ra_last_block; // Last block of the file the previous read covered, or -1 if nothing has been read yet
+    int ra_window; // Current readahead window in blocks, or 0 if the file isn't being read sequentially
+    int ra_end; // First block of the file past what has been prefetched
+    char *append_buf; // APPEND_BUFFER_BLOCKS blocks, allocated by the file's first buffered append
+    int append_len; // Number of bytes in append_buf. They follow the last byte the inode's size covers
 } file_descriptor_t;  // The file descriptor's number is the index into the merged file descriptor and open files table
 
 /**
@@ -55,15 +144,57 @@ typedef struct {
     char file_name[MAXFILENAME];
 } directory_entry_t;
 
+/**
+ * Readahead counters, for all files since the file system was made or opened
+ * windows - number of times blocks were prefetched
+ * blocks_prefetched - blocks prefetched ahead of the read that triggered the prefetch
+ * blocks_hit - blocks later read sequentially that had been prefetched
+ * window - the window of the most recent prefetch, in blocks
+ * max_window - the largest window used
+ */
+typedef struct {
+    long windows;
+    long blocks_prefetched;
+    long blocks_hit;
+    int window;
+    int max_window;
+} readahead_stats_t;
+
+/**
+ * A run of contiguous blocks on disk
+ * start - the number of the first block of the run
+ * length - the number of blocks in the run
+ */
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+} extent_t;
+
 void mksfs(int fresh);
+int mksfs_with_geometry(int fresh, int block_size, int num_blocks, int num_inodes);
 int sfs_getnextfilename(char *fname);
-int sfs_getfilesize(const char* path);
+int64_t sfs_getfilesize(const char* path);
 int sfs_fopen(char *name);
 int sfs_fclose(int fileID);
 int sfs_fread(int fileID, char *buf, int length);
 int sfs_fwrite(int fileID, const char *buf, int length);
-int sfs_fseek(int fileID, int loc);
+int sfs_fseek(int fileID, int64_t loc);
+int sfs_pread(int fileID, char *buf, int length, int64_t offset);
+int sfs_pwrite(int fileID, const char *buf, int length, int64_t offset);
+int sfs_readv(int fileID, const struct iovec *iov, int iovcnt);
+int sfs_writev(int fileID, const struct iovec *iov, int iovcnt);
+int sfs_preadv(int fileID, const struct iovec *iov, int iovcnt, int64_t offset);
+int sfs_pwritev(int fileID, const struct iovec *iov, int iovcnt, int64_t offset);
+int sfs_fflush(int fileID);
+int sfs_punch_hole(int fileID, int64_t offset, int64_t length);
+int sfs_ftruncate(int fileID, int64_t length);
 int sfs_remove(char *file);
+int sfs_sync();
+int sfs_fsync(int fileID);
+void sfs_set_durability(int mode);
+void sfs_set_readahead(int max_blocks);
+void sfs_set_inline_data(int on);
+readahead_stats_t sfs_get_readahead_stats();
 
 // MARK - bitmap stuff
 /**
@@ -91,10 +222,19 @@ int sfs_remove(char *file);
 void force_set_index(unsigned int index);
 
 /*
- * @short find the first free data block
- * @return index of data block to use
+ * @short find the next free data block, starting from where the last search left off
+ * @return index of data block to use, or -1 if the disk is full
+ */
+int get_index();
+
+/*
+ * @short find a run of up to want free blocks, starting at goal if it is free
+ * @param goal block to try to start the run at, usually the block after the end of a file
+ * @param want number of blocks wanted
+ * @param len set to the number of blocks in the run, between 1 and want
+ * @return index of the first block of the run, which is set as used
  */
-unsigned int get_index();
+unsigned int get_index_run(unsigned int goal, int want, int *len);
 
 /*
  * @short frees an index
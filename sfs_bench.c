@@ -0,0 +1,1360 @@
+/* sfs_bench.c
+ *
+ * Micro-benchmarks for the disk emulator and the file system.
+ * Run with the name of a benchmark, or with no arguments to list them.
+ * Results are printed to stderr, as sfs_api is chatty on stdout: ./sfs_bench disk > /dev/null
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+#include "block_cache.h"
+
+#define BENCH_DISK "sfs_bench.disk"
+#define BENCH_OPS 200000
+#define BENCH_MAX_THREADS 8
+
+// sfs_api's fd table, which bench_appends looks at to see how the appended files were laid out on disk
+extern file_descriptor_t *fd_table;
+// sfs_api's lookup of one block of a file that walks the inode's indirect blocks, which bench_indirect compares with
+int get_block_number_corresponding_to_nth_block_for_file(int inode_no, int nth);
+// sfs_api's free block bitmap, which bench_sparse counts the blocks files take up in
+extern uint8_t *free_bit_map;
+
+/**
+ * Returns the current time in seconds from a monotonic clock
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Prints one result line: the name of the measurement, how many operations it covered and how long they took
+ */
+void report(const char *what, int ops, double secs) {
+    fprintf(stderr, "%-36s %8d ops %10.3f ms %10.0f ops/s\n", what, ops, secs * 1e3, ops / secs);
+}
+
+/*********************
+ * Benchmarks
+ *********************/
+
+/**
+ * Compares the stdio and mmap backends of disk_emu on random and sequential single-block reads and writes
+ */
+void bench_disk() {
+    const char *names[] = { "stdio", "mmap" };
+    int backends[] = { DISK_BACKEND_STDIO, DISK_BACKEND_MMAP };
+    char block[BLOCK_SZ];
+    char what[64];
+    memset(block, 0xAB, sizeof(block));
+
+    for (int b = 0; b < 2; b++) {
+        if (init_fresh_disk(BENCH_DISK, BLOCK_SZ, NUM_BLOCKS, backends[b]) == -1) {
+            return;
+        }
+        srand(1);
+        double t = now();
+        for (int i = 0; i < BENCH_OPS; i++) {
+            write_blocks(rand() % NUM_BLOCKS, 1, block);
+        }
+        sync_disk();
+        sprintf(what, "%s: random 1-block writes", names[b]);
+        report(what, BENCH_OPS, now() - t);
+
+        t = now();
+        for (int i = 0; i < BENCH_OPS; i++) {
+            read_blocks(rand() % NUM_BLOCKS, 1, block);
+        }
+        sprintf(what, "%s: random 1-block reads", names[b]);
+        report(what, BENCH_OPS, now() - t);
+
+        t = now();
+        for (int i = 0; i < BENCH_OPS; i++) {
+            read_blocks(i % NUM_BLOCKS, 1, block);
+        }
+        sprintf(what, "%s: sequential 1-block reads", names[b]);
+        report(what, BENCH_OPS, now() - t);
+        close_disk();
+    }
+    remove(BENCH_DISK);
+}
+
+/**
+ * Repeatedly reads a file back in 4 KB chunks, the way FUSE does, and reports the block cache hit rate
+ */
+void bench_cache() {
+    int size = 64 * 1024;
+    int passes = 200;
+    char *data = malloc(size);
+    memset(data, 'c', size);
+
+    mksfs(1);
+    int fd = sfs_fopen("cache.bin");
+    sfs_fwrite(fd, data, size);
+
+    cache_stats_t before = get_cache_stats();
+    double t = now();
+    for (int p = 0; p < passes; p++) {
+        for (int off = 0; off + 4096 < size; off += 4096) {
+            sfs_fseek(fd, off);
+            sfs_fread(fd, data, 4096);
+        }
+    }
+    report("cache: 4 KB sfs_fread", passes * (size / 4096 - 1), now() - t);
+    cache_stats_t after = get_cache_stats();
+    fprintf(stderr, "cache: %ld hits, %ld misses, %ld writebacks\n", after.hits - before.hits,
+            after.misses - before.misses, after.writebacks - before.writebacks);
+
+    sfs_fclose(fd);
+    sfs_sync();
+    close_disk();
+    free(data);
+}
+
+/**
+ * Fills the directory with files and times name lookups through sfs_getfilesize, for names that exist and names that don't
+ */
+void bench_lookup() {
+    int num_files = MAX_DIRECTORY_ENTRIES;
+    char name[MAXFILENAME];
+
+    mksfs(1);
+    for (int i = 0; i < num_files; i++) {
+        sprintf(name, "file%05d.txt", i);
+        sfs_fclose(sfs_fopen(name));
+    }
+
+    double t = now();
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sprintf(name, "file%05d.txt", i % num_files);
+        sfs_getfilesize(name);
+    }
+    report("lookup: existing names", BENCH_OPS, now() - t);
+
+    t = now();
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sprintf(name, "missing%05d.txt", i % num_files);
+        sfs_getfilesize(name);
+    }
+    report("lookup: missing names", BENCH_OPS, now() - t);
+
+    sfs_sync();
+    close_disk();
+}
+
+/**
+ * Times get_index as the disk fills up, one tenth of the disk at a time, and then after freeing every
+ * other block, so that allocation has to search a fragmented bitmap
+ */
+void bench_alloc() {
+    char what[64];
+    int num_bits = BIT_MAP_SIZE * 8;
+    int allocated[BIT_MAP_SIZE * 8];
+    int n = 0;
+    int full = 0;
+
+    mksfs(1);
+    // Allocation is next-fit, so on a fresh disk the last index handed out tells how full the disk is
+    int used = 0;
+    while (!full && used < num_bits) {
+        int decile = (used * 10) / num_bits + 1;
+        int ops = 0;
+        double t = now();
+        while ((used * 10) / num_bits + 1 == decile) {
+            int index = get_index();
+            if (index == -1) {
+                full = 1;
+                break;
+            }
+            allocated[n++] = index;
+            used = index + 1;
+            ops++;
+        }
+        sprintf(what, "alloc: get_index up to %d%% full", decile * 10);
+        report(what, ops, now() - t);
+    }
+    if (get_index() != -1) {
+        fprintf(stderr, "alloc: expected the disk to be full\n");
+    }
+
+    for (int i = 0; i < n; i += 2) {
+        rm_index(allocated[i]);
+    }
+    double t = now();
+    for (int i = 0; i < n; i += 2) {
+        get_index();
+    }
+    report("alloc: get_index, every other free", (n + 1) / 2, now() - t);
+    close_disk();
+}
+
+/**
+ * Reads and overwrites a cached 256 KB file in chunks of several sizes, and reports how many bytes were
+ * memcpy'd for every byte the caller asked for. sfs_api copies file data only through the block cache,
+ * so the cache's bytes_copied counts every copy
+ */
+void bench_copies() {
+    int size = 256 * 1024;
+    int chunk_sizes[] = { 100, 1024, 4096, 65536 };
+    char *data = malloc(size);
+    char what[64];
+    memset(data, 'z', size);
+
+    mksfs(1);
+    int fd = sfs_fopen("copies.bin");
+    sfs_pwrite(fd, data, size, 0);
+    for (int c = 0; c < 4; c++) {
+        int chunk = chunk_sizes[c];
+        for (int write = 0; write < 2; write++) {
+            long before = get_cache_stats().bytes_copied;
+            long served = 0;
+            int ops = 0;
+            double t = now();
+            for (int off = 0; off + chunk <= size; off += chunk) {
+                if (write) {
+                    sfs_pwrite(fd, data + off, chunk, off);
+                } else {
+                    sfs_pread(fd, data + off, chunk, off);
+                }
+                served += chunk;
+                ops++;
+            }
+            double secs = now() - t;
+            long copied = get_cache_stats().bytes_copied - before;
+            sprintf(what, "copies: %s %d B chunks", write ? "write" : "read", chunk);
+            report(what, ops, secs);
+            fprintf(stderr, "copies: %s %d B chunks: %.2f bytes copied per byte served\n",
+                    write ? "write" : "read", chunk, (double) copied / served);
+        }
+    }
+    sfs_fclose(fd);
+    sfs_sync();
+    close_disk();
+    free(data);
+}
+
+/**
+ * Appends to two files in turn, as two logs being written at once would, in appends of 1 B to 4 KB until each
+ * file holds 64 KB, then syncs. Reports the time taken and how many extents the files' blocks ended up in
+ */
+void bench_appends() {
+    int size = 64 * 1024;
+    int append_sizes[] = { 1, 16, 128, 1024, 4096 };
+    char data[4096];
+    char what[64];
+    memset(data, 'a', sizeof(data));
+
+    for (int a = 0; a < 5; a++) {
+        int chunk = append_sizes[a];
+        mksfs(1);
+        int fds[2] = { sfs_fopen("log0.txt"), sfs_fopen("log1.txt") };
+        double t = now();
+        for (int off = 0; off < size; off += chunk) {
+            for (int f = 0; f < 2; f++) {
+                sfs_pwrite(fds[f], data, chunk, off);
+            }
+        }
+        sfs_sync();
+        double secs = now() - t;
+        int extents = 0;
+        for (int f = 0; f < 2; f++) {
+            unsigned int *map = fd_table[fds[f]].block_map;
+            for (int b = 0; b < fd_table[fds[f]].map_len; b++) {
+                if (b == 0 || map[b] != map[b - 1] + 1) {
+                    extents++;
+                }
+            }
+        }
+        sprintf(what, "appends: %d B", chunk);
+        report(what, 2 * (size / chunk), secs);
+        fprintf(stderr, "appends: %d B: %d blocks in %d extents\n", chunk, 2 * size / BLOCK_SZ, extents);
+        sfs_fclose(fds[0]);
+        sfs_fclose(fds[1]);
+        close_disk();
+    }
+}
+
+/**
+ * Writes a 2.5 MB file, whose blocks reach into the double indirect tree, and times random 1-byte reads in the
+ * part of it each kind of pointer leads to, starting from an empty block cache. Reports the disk reads each lookup
+ * costs through the open file's block map, and through a walk of the indirect blocks, as a lookup without the map would.
+ * The disk is too small for a file to reach the triple indirect tree
+ */
+void bench_indirect() {
+    int size = 2500 * 1024;
+    int lookups = 1000;
+    const char *names[] = { "direct", "single indirect", "double indirect" };
+    int first[] = { 0, NUM_DIRECT_POINTERS, NUM_DIRECT_POINTERS + NUM_INDIRECT_POINTERS };
+    int count[] = { NUM_DIRECT_POINTERS, NUM_INDIRECT_POINTERS, size / BLOCK_SZ - first[2] };
+    char *data = malloc(size);
+    char what[64];
+    char c;
+    memset(data, 'i', size);
+
+    mksfs(1);
+    int fd = sfs_fopen("large.bin");
+    for (int off = 0; off < size; off += 64 * 1024) {
+        sfs_pwrite(fd, data + off, (size - off < 64 * 1024) ? size - off : 64 * 1024, off);
+    }
+    sfs_fclose(fd);
+    sfs_sync();
+    close_disk();
+
+    mksfs(0);
+    long reads = get_cache_stats().disk_reads;
+    double t = now();
+    fd = sfs_fopen("large.bin");
+    report("indirect: open, resolving block map", 1, now() - t);
+    fprintf(stderr, "indirect: open: %ld disk reads for %d blocks\n", get_cache_stats().disk_reads - reads, size / BLOCK_SZ);
+    int inode_no = fd_table[fd].inode_no;
+    close_disk();
+
+    for (int walk = 0; walk < 2; walk++) {
+        for (int r = 0; r < 3; r++) {
+            // Start every run from an empty cache, so the indirect blocks it needs have to come from disk.
+            // Walks don't open the file, as that would resolve its block map and cache its indirect blocks
+            mksfs(0);
+            fd = walk ? -1 : sfs_fopen("large.bin");
+            srand(r);
+            reads = get_cache_stats().disk_reads;
+            t = now();
+            for (int i = 0; i < lookups; i++) {
+                int nth = first[r] + rand() % count[r];
+                if (walk) {
+                    get_block_number_corresponding_to_nth_block_for_file(inode_no, nth);
+                } else {
+                    sfs_pread(fd, &c, 1, nth * BLOCK_SZ + rand() % BLOCK_SZ);
+                }
+            }
+            double secs = now() - t;
+            reads = get_cache_stats().disk_reads - reads;
+            sprintf(what, "indirect: %s, %s", walk ? "walk" : "read", names[r]);
+            report(what, lookups, secs);
+            fprintf(stderr, "indirect: %s, %s: %.2f disk reads per lookup%s\n", walk ? "walk" : "read", names[r],
+                    (double) reads / lookups, walk ? "" : ", counting the data block read");
+            if (!walk) {
+                sfs_fclose(fd);
+            }
+            close_disk();
+        }
+    }
+    free(data);
+}
+
+/**
+ * Returns the number of free blocks in the free block bitmap
+ */
+int count_free_blocks() {
+    int n = 0;
+    for (int i = 0; i < BIT_MAP_SIZE * 8; i++) {
+        if (free_bit_map[i / 8] & (1 << (i % 8))) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * Writes a 2 MB image file that is mostly zeros, with 4 KB of data every 256 KB, as a VM image or core dump is:
+ * once writing every byte, and once seeking over the zeros. Reports the blocks each file takes up and the disk reads
+ * a cold read of the whole file makes, then punches the zeros out of the dense file and reports what that frees
+ */
+void bench_sparse() {
+    int size = 2 * 1024 * 1024;
+    int stride = 256 * 1024;
+    int chunk = 4096;
+    char *data = calloc(size, 1);
+    char *back = malloc(size);
+    char what[64];
+    for (int off = 0; off < size; off += stride) {
+        memset(data + off, 's', chunk);
+    }
+
+    for (int sparse = 0; sparse < 2; sparse++) {
+        mksfs(1);
+        int free_before = count_free_blocks();
+        int fd = sfs_fopen("image.bin");
+        double t = now();
+        if (sparse) {
+            for (int off = 0; off < size; off += stride) {
+                sfs_pwrite(fd, data + off, chunk, off);
+            }
+            // Set the size, as the image ends in zeros
+            sfs_pwrite(fd, data + size - 1, 1, size - 1);
+        } else {
+            for (int off = 0; off < size; off += 64 * 1024) {
+                sfs_pwrite(fd, data + off, 64 * 1024, off);
+            }
+        }
+        sfs_fclose(fd);
+        sfs_sync();
+        sprintf(what, "sparse: write, %s", sparse ? "sparse" : "dense");
+        report(what, size / BLOCK_SZ, now() - t);
+        fprintf(stderr, "sparse: write, %s: %d blocks used for a %d block file\n", sparse ? "sparse" : "dense",
+                free_before - count_free_blocks(), size / BLOCK_SZ);
+        close_disk();
+
+        mksfs(0);
+        fd = sfs_fopen("image.bin");
+        long reads = get_cache_stats().disk_reads;
+        t = now();
+        sfs_pread(fd, back, size, 0);
+        sprintf(what, "sparse: cold read, %s", sparse ? "sparse" : "dense");
+        report(what, size / BLOCK_SZ, now() - t);
+        fprintf(stderr, "sparse: cold read, %s: %ld disk reads%s\n", sparse ? "sparse" : "dense",
+                get_cache_stats().disk_reads - reads, memcmp(back, data, size) ? ", read back wrong" : "");
+
+        if (!sparse) {
+            int free_before_punch = count_free_blocks();
+            t = now();
+            int holes = 0;
+            for (int off = 0; off < size; off += stride) {
+                sfs_punch_hole(fd, off + chunk, stride - chunk);
+                holes++;
+            }
+            sfs_sync();
+            report("sparse: punch zeros out of dense", holes, now() - t);
+            fprintf(stderr, "sparse: punch: %d blocks freed\n", count_free_blocks() - free_before_punch);
+        }
+        sfs_fclose(fd);
+        close_disk();
+    }
+    free(data);
+    free(back);
+}
+
+/**
+ * Streams a 16 MB file onto a 64 MB disk in 64 KB writes, and reads it back from an empty block cache in 64 KB reads,
+ * on file systems made with 1 KB, 4 KB and 64 KB blocks. Reports the disk reads the read back makes, and the
+ * blocks of metadata (superblock, free bit map, inode table, journal and root directory) each file system has
+ */
+void bench_geometry() {
+    int disk_size = 64 * 1024 * 1024;
+    int size = 16 * 1024 * 1024;
+    int chunk = 64 * 1024;
+    int block_sizes[] = { 1024, 4096, 65536 };
+    char *data = malloc(size);
+    char *back = malloc(chunk);
+    char what[64];
+    memset(data, 'g', size);
+
+    for (int g = 0; g < 3; g++) {
+        int block_size = block_sizes[g];
+        if (mksfs_with_geometry(1, block_size, disk_size / block_size, DEFAULT_NUM_INODES) == -1) {
+            fprintf(stderr, "geometry: could not make a file system with %d B blocks\n", block_size);
+            continue;
+        }
+        int metadata_blocks = NUM_BLOCKS - count_free_blocks();
+        int fd = sfs_fopen("stream.bin");
+        double t = now();
+        for (int off = 0; off < size; off += chunk) {
+            sfs_pwrite(fd, data + off, chunk, off);
+        }
+        sfs_fclose(fd);
+        sfs_sync();
+        sprintf(what, "geometry: %d KB blocks, write", block_size / 1024);
+        report(what, size / chunk, now() - t);
+        close_disk();
+
+        // Reopening takes the geometry from the superblock, and starts with an empty cache
+        mksfs(0);
+        fd = sfs_fopen("stream.bin");
+        long reads = get_cache_stats().disk_reads;
+        t = now();
+        for (int off = 0; off < size; off += chunk) {
+            sfs_pread(fd, back, chunk, off);
+        }
+        sprintf(what, "geometry: %d KB blocks, cold read", block_size / 1024);
+        report(what, size / chunk, now() - t);
+        fprintf(stderr, "geometry: %d KB blocks: %ld disk reads, %d blocks (%d KB) of metadata\n", block_size / 1024,
+                get_cache_stats().disk_reads - reads, metadata_blocks, metadata_blocks * (block_size / 1024));
+        sfs_fclose(fd);
+        close_disk();
+    }
+    free(data);
+    free(back);
+}
+
+/**
+ * Checks that offsets past 2 GB and 4 GB work, in files and on disk. Writes 1 MB at 0, 3 GB and 5 GB of a sparse
+ * file on a small disk, and reads it back after reopening the disk. Then makes a 5 GB disk of 64 KB blocks, takes
+ * every block below 4.5 GB so that a file's blocks land past 4 GB, writes 8 MB to it and reads that back
+ */
+void bench_large() {
+    int64_t offsets[] = { 0, 3LL << 30, 5LL << 30 };
+    int chunk = 1024 * 1024;
+    char *data = malloc(8 * chunk);
+    char *back = malloc(8 * chunk);
+    int wrong = 0;
+    for (int i = 0; i < 8 * chunk; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    mksfs_with_geometry(1, 4096, 4096, DEFAULT_NUM_INODES);
+    int fd = sfs_fopen("sparse.bin");
+    double t = now();
+    for (int i = 0; i < 3; i++) {
+        sfs_pwrite(fd, data, chunk, offsets[i]);
+    }
+    sfs_fclose(fd);
+    sfs_sync();
+    report("large: 1 MB writes at 0, 3 GB, 5 GB", 3, now() - t);
+    close_disk();
+    mksfs(0);
+    fd = sfs_fopen("sparse.bin");
+    t = now();
+    for (int i = 0; i < 3; i++) {
+        wrong += (sfs_pread(fd, back, chunk, offsets[i]) != chunk || memcmp(back, data, chunk) != 0);
+    }
+    // The middle of the file is a hole
+    wrong += (sfs_pread(fd, back, chunk, 4LL << 30) != chunk || back[0] != 0 || back[chunk - 1] != 0);
+    report("large: 1 MB reads at 0, 3 GB, 5 GB", 3, now() - t);
+    fprintf(stderr, "large: file of %lld bytes, %d of 4 reads wrong\n", (long long) sfs_getfilesize("sparse.bin"), wrong);
+    sfs_fclose(fd);
+    close_disk();
+
+    int block_size = 64 * 1024;
+    int num_blocks = (int) ((5LL << 30) / block_size);
+    t = now();
+    if (mksfs_with_geometry(1, block_size, num_blocks, DEFAULT_NUM_INODES) == -1) {
+        fprintf(stderr, "large: could not make a 5 GB file system\n");
+        free(data);
+        free(back);
+        return;
+    }
+    report("large: mksfs, 5 GB disk", 1, now() - t);
+    for (int b = 0; b < (int) ((9LL << 29) / block_size); b++) {
+        force_set_index(b);
+    }
+    fd = sfs_fopen("high.bin");
+    t = now();
+    sfs_pwrite(fd, data, 8 * chunk, 0);
+    sfs_fclose(fd);
+    sfs_sync();
+    report("large: 8 MB write past 4.5 GB of disk", 1, now() - t);
+    close_disk();
+    mksfs(0);
+    fd = sfs_fopen("high.bin");
+    unsigned int first = fd_table[fd].block_map[0];
+    t = now();
+    wrong = (sfs_pread(fd, back, 8 * chunk, 0) != 8 * chunk || memcmp(back, data, 8 * chunk) != 0);
+    report("large: 8 MB read past 4.5 GB of disk", 1, now() - t);
+    fprintf(stderr, "large: file starts at byte %lld of the disk, read back %s\n", (long long) first * block_size,
+            wrong ? "wrong" : "right");
+    sfs_fclose(fd);
+    close_disk();
+    remove(KEITHS_DISK);
+    free(data);
+    free(back);
+}
+
+/**
+ * Makes file systems of 4 KB blocks on disks of 16 MB to 16 GB, and times mksfs. Reports how much of each disk file
+ * is actually stored, as the file starts out sparse, and checks that each file system opens again and holds a file
+ */
+void bench_mkfs() {
+    long long disk_sizes[] = { 16LL << 20, 256LL << 20, 4LL << 30, 16LL << 30 };
+    int block_size = 4096;
+    char data[] = "made on a sparse disk";
+    char back[sizeof(data)];
+    char what[64];
+
+    for (int d = 0; d < 4; d++) {
+        double t = now();
+        if (mksfs_with_geometry(1, block_size, (int) (disk_sizes[d] / block_size), DEFAULT_NUM_INODES) == -1) {
+            fprintf(stderr, "mkfs: could not make a %lld MB file system\n", disk_sizes[d] >> 20);
+            continue;
+        }
+        sprintf(what, "mkfs: %lld MB disk", disk_sizes[d] >> 20);
+        report(what, 1, now() - t);
+        int fd = sfs_fopen("hello.txt");
+        sfs_fwrite(fd, data, sizeof(data));
+        sfs_fclose(fd);
+        sfs_sync();
+        close_disk();
+
+        mksfs(0);
+        fd = sfs_fopen("hello.txt");
+        int wrong = sfs_pread(fd, back, sizeof(data), 0) != sizeof(data) || memcmp(back, data, sizeof(data)) != 0;
+        sfs_fclose(fd);
+        close_disk();
+        struct stat st;
+        stat(KEITHS_DISK, &st);
+        fprintf(stderr, "mkfs: %lld MB disk: %lld KB stored, file read back %s\n", disk_sizes[d] >> 20,
+                (long long) st.st_blocks * 512 / 1024, wrong ? "wrong" : "right");
+    }
+    remove(KEITHS_DISK);
+}
+
+/**
+ * Sweeps the queue depth of disk_emu's asynchronous interface, with io_uring and with the thread pool: random 4 KB
+ * reads of a 64 MB disk, keeping that many requests in flight. Then reads back a file whose blocks are interleaved
+ * with another file's from an empty block cache in 1 MB reads, once with requests carried out one at a time and once
+ * with all of each read's extents in flight together
+ */
+void bench_async() {
+    const char *names[] = { "io_uring", "threads" };
+    int engines[] = { DISK_ASYNC_URING, DISK_ASYNC_THREADS };
+    int depths[] = { 1, 4, 16, 64 };
+    int block_size = 4096;
+    int num_blocks = 16384;
+    int ops = BENCH_OPS / 10;
+    char *buf = malloc((size_t) 64 * block_size);
+    disk_request_t requests[64];
+    char what[64];
+
+    if (init_fresh_disk(BENCH_DISK, block_size, num_blocks, DISK_BACKEND_STDIO) == -1) {
+        free(buf);
+        return;
+    }
+    memset(buf, 'q', (size_t) 64 * block_size);
+    for (int b = 0; b < num_blocks; b += 64) {
+        write_blocks(b, 64, buf);
+    }
+    double t = now();
+    for (int i = 0; i < ops; i++) {
+        read_blocks(rand() % num_blocks, 1, buf);
+    }
+    report("async: blocking read_blocks", ops, now() - t);
+
+    for (int e = 0; e < 2; e++) {
+        for (int d = 0; d < 4; d++) {
+            int depth = depths[d];
+            if (init_async_io(engines[e], depth) != engines[e]) {
+                continue;
+            }
+            disk_queue_t queue = { 0, 0, NULL };
+            int submitted = 0;
+            srand(1);
+            t = now();
+            for (int r = 0; r < depth; r++, submitted++) {
+                requests[r] = (disk_request_t) { 0, rand() % num_blocks, 1, buf + (size_t) r * block_size };
+                submit_request(&queue, &requests[r]);
+            }
+            // Resubmit each request as soon as it completes, so there are always depth of them in flight
+            for (int completed = 0; completed < ops; ) {
+                completed += reap_requests(&queue, 1);
+                for (int r = 0; r < depth; r++) {
+                    if (requests[r].done && submitted < ops) {
+                        requests[r].start_address = rand() % num_blocks;
+                        submit_request(&queue, &requests[r]);
+                        submitted++;
+                    }
+                }
+            }
+            sprintf(what, "async: %s, queue depth %d", names[e], depth);
+            report(what, ops, now() - t);
+        }
+    }
+    close_disk();
+    remove(BENCH_DISK);
+
+    // Two files written in turn, so each is in extents of APPEND_BUFFER_BLOCKS blocks
+    int size = 2 * 1024 * 1024;
+    int chunk = 1024 * 1024;
+    char *data = malloc(chunk);
+    memset(data, 'i', chunk);
+    mksfs(1);
+    int fds[2] = { sfs_fopen("even.bin"), sfs_fopen("odd.bin") };
+    for (int off = 0; off < size; off += 4096) {
+        for (int f = 0; f < 2; f++) {
+            sfs_pwrite(fds[f], data, 4096, off);
+        }
+    }
+    sfs_fclose(fds[0]);
+    sfs_fclose(fds[1]);
+    sfs_sync();
+    close_disk();
+    for (int a = 0; a < 2; a++) {
+        mksfs(0);
+        init_async_io(a ? KEITHS_ASYNC_ENGINE : DISK_ASYNC_NONE, ASYNC_QUEUE_DEPTH);
+        sfs_set_readahead(0);
+        int fd = sfs_fopen("even.bin");
+        long reads = get_cache_stats().disk_reads;
+        t = now();
+        for (int off = 0; off < size; off += chunk) {
+            sfs_pread(fd, data, chunk, off);
+        }
+        sprintf(what, "async: interleaved file, %s", a ? "all in flight" : "one at a time");
+        report(what, size / chunk, now() - t);
+        fprintf(stderr, "async: interleaved file: %ld disk requests\n", get_cache_stats().disk_reads - reads);
+        sfs_fclose(fd);
+        close_disk();
+    }
+    sfs_set_readahead(READAHEAD_MAX_BLOCKS);
+    remove(KEITHS_DISK);
+    free(data);
+    free(buf);
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * Reads a file of sfs_api's disk in 64 KB reads, on the device being modelled, and reports the time the device's
+ * clock says it took
+ */
+void time_device_read(const char *what, char *name, int engine) {
+    int chunk = 64 * 1024;
+    char *buf = malloc(chunk);
+    init_async_io(engine, ASYNC_QUEUE_DEPTH);
+    int fd = sfs_fopen(name);
+    int64_t size = sfs_getfilesize(name);
+    reset_device_clock();
+    for (int64_t off = 0; off < size; off += chunk) {
+        sfs_pread(fd, buf, chunk, off);
+    }
+    device_stats_t stats = get_device_stats();
+    fprintf(stderr, "%-36s %8.3f ms on the device, %ld requests, %ld seeks\n", what, stats.elapsed * 1e3,
+            stats.requests, stats.seeks);
+    sfs_fclose(fd);
+    free(buf);
+}
+
+/**
+ * Runs the same workloads on a modelled hard disk and SSD, on a virtual clock, to see what pays off on which:
+ * 1000 random block writes in random order and sorted by block number, as flush_block_cache sorts them; random
+ * 4 KB reads with 1 and 32 requests in flight; and reading a contiguous 1 MB file cold and then from the cache, and
+ * one whose blocks are interleaved with another file's, cold with requests one at a time and all in flight.
+ * Readahead is off, so each read's own requests are measured
+ */
+void bench_device() {
+    const char *names[] = { "hdd", "ssd" };
+    const device_model_t *models[] = { &DEVICE_HDD, &DEVICE_SSD };
+    int block_size = 4096;
+    int num_blocks = 65536;
+    int writes = 1000;
+    int reads = 2000;
+    int file_size = 1024 * 1024;
+    int *blocks = malloc(sizeof(int) * writes);
+    char *buf = malloc((size_t) 32 * block_size);
+    disk_request_t requests[32];
+    char what[64];
+    memset(buf, 'd', (size_t) 32 * block_size);
+
+    // The files for the file system part, made once without a device model
+    mksfs_with_geometry(1, block_size, 16384, DEFAULT_NUM_INODES);
+    int fd = sfs_fopen("contiguous.bin");
+    for (int off = 0; off < file_size; off += 16 * block_size) {
+        sfs_pwrite(fd, buf, 16 * block_size, off);
+    }
+    sfs_fclose(fd);
+    // Flushing after every block gives each its own allocation, so the two files' blocks alternate on disk
+    int fds[2] = { sfs_fopen("interleaved.bin"), sfs_fopen("other.bin") };
+    for (int off = 0; off < file_size; off += block_size) {
+        for (int f = 0; f < 2; f++) {
+            sfs_pwrite(fds[f], buf, block_size, off);
+            sfs_fflush(fds[f]);
+        }
+    }
+    sfs_fclose(fds[0]);
+    sfs_fclose(fds[1]);
+    sfs_sync();
+    close_disk();
+
+    for (int m = 0; m < 2; m++) {
+        if (init_fresh_disk(BENCH_DISK, block_size, num_blocks, DISK_BACKEND_STDIO) == -1) {
+            break;
+        }
+        set_device_model(models[m]);
+        srand(1);
+        for (int i = 0; i < writes; i++) {
+            blocks[i] = rand() % num_blocks;
+        }
+        for (int sorted = 0; sorted < 2; sorted++) {
+            if (sorted) {
+                qsort(blocks, writes, sizeof(int), compare_ints);
+            }
+            reset_device_clock();
+            for (int i = 0; i < writes; i++) {
+                write_blocks(blocks[i], 1, buf);
+            }
+            sprintf(what, "device: %s, writes %s", names[m], sorted ? "sorted" : "unsorted");
+            report(what, writes, get_device_stats().elapsed);
+        }
+
+        int depths[] = { 1, 32 };
+        for (int d = 0; d < 2; d++) {
+            int depth = depths[d];
+            init_async_io(KEITHS_ASYNC_ENGINE, depth);
+            disk_queue_t queue = { 0, 0, NULL };
+            int submitted = 0;
+            reset_device_clock();
+            for (int r = 0; r < depth; r++, submitted++) {
+                requests[r] = (disk_request_t) { 0, rand() % num_blocks, 1, buf + (size_t) r * block_size };
+                submit_request(&queue, &requests[r]);
+            }
+            for (int completed = 0; completed < reads; ) {
+                completed += reap_requests(&queue, 1);
+                for (int r = 0; r < depth; r++) {
+                    if (requests[r].done && submitted < reads) {
+                        requests[r].start_address = rand() % num_blocks;
+                        submit_request(&queue, &requests[r]);
+                        submitted++;
+                    }
+                }
+            }
+            sprintf(what, "device: %s, reads at depth %d", names[m], depth);
+            report(what, reads, get_device_stats().elapsed);
+        }
+        close_disk();
+
+        mksfs(0);
+        sfs_set_readahead(0);
+        sprintf(what, "device: %s, contiguous cold", names[m]);
+        time_device_read(what, "contiguous.bin", DISK_ASYNC_NONE);
+        sprintf(what, "device: %s, contiguous cached", names[m]);
+        time_device_read(what, "contiguous.bin", DISK_ASYNC_NONE);
+        close_disk();
+        for (int a = 0; a < 2; a++) {
+            mksfs(0);
+            sfs_set_readahead(0);
+            sprintf(what, "device: %s, interleaved %s", names[m], a ? "all in flight" : "one at a time");
+            time_device_read(what, "interleaved.bin", a ? KEITHS_ASYNC_ENGINE : DISK_ASYNC_NONE);
+            close_disk();
+        }
+        set_device_model(NULL);
+    }
+    sfs_set_readahead(READAHEAD_MAX_BLOCKS);
+    remove(BENCH_DISK);
+    remove(KEITHS_DISK);
+    free(blocks);
+    free(buf);
+}
+
+/**
+ * Measures write throughput under each durability mode: random 1-block writes straight to disk_emu, with one
+ * sync_disk at the end, and a 4 MB file written to sfs_api in 4 KB writes with an sfs_fsync every 64 KB, the way a
+ * log that commits regularly would be
+ */
+void bench_durability() {
+    const char *names[] = { "none", "on sync", "every write" };
+    int modes[] = { DISK_DURABILITY_NONE, DISK_DURABILITY_ON_SYNC, DISK_DURABILITY_EVERY_WRITE };
+    int block_size = 4096;
+    int num_blocks = 16384;
+    int writes = 2000;
+    int size = 4 * 1024 * 1024;
+    char *buf = malloc(block_size);
+    char what[64];
+    memset(buf, 'w', block_size);
+
+    for (int m = 0; m < 3; m++) {
+        set_disk_durability(modes[m]);
+        if (init_fresh_disk(BENCH_DISK, block_size, num_blocks, DISK_BACKEND_STDIO) == -1) {
+            break;
+        }
+        srand(1);
+        double t = now();
+        for (int i = 0; i < writes; i++) {
+            write_blocks(rand() % num_blocks, 1, buf);
+        }
+        sync_disk();
+        sprintf(what, "durability: %s, block writes", names[m]);
+        report(what, writes, now() - t);
+        close_disk();
+
+        sfs_set_durability(modes[m]);
+        mksfs_with_geometry(1, block_size, num_blocks, DEFAULT_NUM_INODES);
+        int fd = sfs_fopen("log.bin");
+        t = now();
+        for (int off = 0; off < size; off += block_size) {
+            sfs_pwrite(fd, buf, block_size, off);
+            if ((off + block_size) % (64 * 1024) == 0) {
+                sfs_fsync(fd);
+            }
+        }
+        double secs = now() - t;
+        sprintf(what, "durability: %s, 4 KB writes", names[m]);
+        report(what, size / block_size, secs);
+        fprintf(stderr, "durability: %s: %.1f MB/s with an fsync every 64 KB\n", names[m], size / secs / (1024 * 1024));
+        sfs_fclose(fd);
+        close_disk();
+    }
+    set_disk_durability(KEITHS_DISK_DURABILITY);
+    sfs_set_durability(KEITHS_DISK_DURABILITY);
+    remove(BENCH_DISK);
+    remove(KEITHS_DISK);
+    free(buf);
+}
+
+/**
+ * Writes 4000 records of 8 fragments between 8 B and 200 B, as an ingest path that builds each record from several
+ * small buffers does: with one sfs_pwrite per fragment, by copying the fragments into one buffer for a single
+ * sfs_pwrite, and with one sfs_pwritev per record. Reads the file back through sfs_preadv to check it. Then does
+ * the same at the disk level, writing blocks gathered from 8 pieces with write_blocks_v, or copied for write_blocks
+ */
+void bench_vectored() {
+    int frag_sizes[] = { 16, 40, 8, 120, 32, 64, 200, 24 };
+    const char *names[] = { "pwrite per fragment", "copied, one pwrite", "pwritev" };
+    int num_frags = 8;
+    int records = 4000;
+    int record_size = 0;
+    char *frags[8];
+    struct iovec iov[8];
+    char what[64];
+    for (int f = 0; f < num_frags; f++) {
+        frags[f] = malloc(frag_sizes[f]);
+        iov[f].iov_base = frags[f];
+        iov[f].iov_len = frag_sizes[f];
+        record_size += frag_sizes[f];
+    }
+    char *record = malloc(record_size);
+
+    for (int m = 0; m < 3; m++) {
+        mksfs(1);
+        int fd = sfs_fopen("ingest.bin");
+        double t = now();
+        for (int r = 0; r < records; r++) {
+            int64_t off = (int64_t) r * record_size;
+            for (int f = 0; f < num_frags; f++) {
+                memset(frags[f], 'a' + (r + f) % 26, frag_sizes[f]);
+            }
+            if (m == 0) {
+                for (int f = 0; f < num_frags; f++) {
+                    sfs_pwrite(fd, frags[f], frag_sizes[f], off);
+                    off += frag_sizes[f];
+                }
+            } else if (m == 1) {
+                int len = 0;
+                for (int f = 0; f < num_frags; f++) {
+                    memcpy(record + len, frags[f], frag_sizes[f]);
+                    len += frag_sizes[f];
+                }
+                sfs_pwrite(fd, record, len, off);
+            } else {
+                sfs_pwritev(fd, iov, num_frags, off);
+            }
+        }
+        sfs_sync();
+        double secs = now() - t;
+        sprintf(what, "vectored: %s", names[m]);
+        report(what, records, secs);
+
+        int bad = 0;
+        for (int r = 0; r < records; r++) {
+            if (sfs_preadv(fd, iov, num_frags, (int64_t) r * record_size) != record_size) {
+                bad++;
+                continue;
+            }
+            for (int f = 0; f < num_frags; f++) {
+                for (int i = 0; i < frag_sizes[f]; i++) {
+                    if (frags[f][i] != 'a' + (r + f) % 26) {
+                        bad++;
+                        f = num_frags;
+                        break;
+                    }
+                }
+            }
+        }
+        fprintf(stderr, "vectored: %s: %.1f MB/s, %d of %d records read back wrong\n",
+                names[m], (double) records * record_size / secs / (1024 * 1024), bad, records);
+        sfs_fclose(fd);
+        close_disk();
+    }
+    remove(KEITHS_DISK);
+
+    // At the disk level, each 4 KB block is gathered from 8 pieces of 512 B
+    int block_size = 4096;
+    int num_blocks = 16384;
+    char *block = malloc(block_size);
+    char *source = malloc(block_size);
+    struct iovec pieces[8];
+    memset(source, 'v', block_size);
+    for (int f = 0; f < 8; f++) {
+        // The pieces come from all over, here in the reverse of the order they are written in
+        pieces[f].iov_base = source + (7 - f) * (block_size / 8);
+        pieces[f].iov_len = block_size / 8;
+    }
+    for (int v = 0; v < 2; v++) {
+        if (init_fresh_disk(BENCH_DISK, block_size, num_blocks, DISK_BACKEND_STDIO) == -1) {
+            break;
+        }
+        double t = now();
+        for (int b = 0; b < num_blocks; b++) {
+            if (v) {
+                write_blocks_v(b, 1, pieces, 8);
+            } else {
+                for (int f = 0; f < 8; f++) {
+                    memcpy(block + f * (block_size / 8), pieces[f].iov_base, block_size / 8);
+                }
+                write_blocks(b, 1, block);
+            }
+        }
+        sync_disk();
+        sprintf(what, "vectored: %s", v ? "write_blocks_v" : "copied, write_blocks");
+        report(what, num_blocks, now() - t);
+        close_disk();
+    }
+    remove(BENCH_DISK);
+    free(block);
+    free(source);
+    free(record);
+    for (int f = 0; f < num_frags; f++) {
+        free(frags[f]);
+    }
+}
+
+/**
+ * Writes 400 files of 100 B to 400 B, as a directory of small config or metadata files, with inline data off and on.
+ * Reports the time to create them and to read them all back from a freshly opened disk, the data blocks they take
+ * up, and the read_blocks calls reading them back makes once the inode table is in memory
+ */
+void bench_inline() {
+    int files = 400;
+    int lens[400];
+    char data[512];
+    char back[512];
+    char name[MAXFILENAME];
+    char what[64];
+
+    for (int on = 0; on < 2; on++) {
+        sfs_set_inline_data(on);
+        mksfs_with_geometry(1, 1024, 8192, 512);
+        int free_before = count_free_blocks();
+        srand(1);
+        double t = now();
+        for (int i = 0; i < files; i++) {
+            int len = lens[i] = 100 + rand() % 300;
+            memset(data, 'a' + i % 26, len);
+            sprintf(name, "small%d.cfg", i);
+            int fd = sfs_fopen(name);
+            sfs_fwrite(fd, data, len);
+            sfs_fclose(fd);
+        }
+        sfs_sync();
+        sprintf(what, "inline: %s, create", on ? "on" : "off");
+        report(what, files, now() - t);
+        int blocks = free_before - count_free_blocks();
+        close_disk();
+
+        // Reopening the disk starts with an empty cache, and reads in the inode table
+        mksfs_with_geometry(0, 1024, 8192, 512);
+        long reads_before = get_cache_stats().disk_reads;
+        int bad = 0;
+        t = now();
+        for (int i = 0; i < files; i++) {
+            sprintf(name, "small%d.cfg", i);
+            int fd = sfs_fopen(name);
+            if (sfs_pread(fd, back, sizeof(back), 0) != lens[i] || back[lens[i] - 1] != 'a' + i % 26) {
+                bad++;
+            }
+            sfs_fclose(fd);
+        }
+        double secs = now() - t;
+        long reads = get_cache_stats().disk_reads - reads_before;
+        sprintf(what, "inline: %s, cold read", on ? "on" : "off");
+        report(what, files, secs);
+        fprintf(stderr, "inline: %s: %d files in %d data blocks, %ld read_blocks calls to read them back, %d wrong\n",
+                on ? "on" : "off", files, blocks, reads, bad);
+        close_disk();
+    }
+    sfs_set_inline_data(1);
+    remove(KEITHS_DISK);
+}
+
+/**
+ * Reads a 256 KB file that isn't in the block cache from start to end in 4 KB chunks, as a FUSE cat or backup
+ * does, with readahead off and on, and reports the read_blocks calls made and readahead's window and hit rate
+ */
+void bench_readahead() {
+    int size = 256 * 1024;
+    char *data = malloc(size);
+    char chunk[4096];
+    char what[64];
+    memset(data, 'r', size);
+
+    mksfs(1);
+    int fd = sfs_fopen("seq.bin");
+    sfs_pwrite(fd, data, size, 0);
+    sfs_fclose(fd);
+    sfs_sync();
+    close_disk();
+    for (int on = 0; on < 2; on++) {
+        sfs_set_readahead(on ? READAHEAD_MAX_BLOCKS : 0);
+        // Reopening the disk starts with an empty cache
+        mksfs(0);
+        fd = sfs_fopen("seq.bin");
+        long reads_before = get_cache_stats().disk_reads;
+        double t = now();
+        for (int off = 0; off < size; off += sizeof(chunk)) {
+            sfs_pread(fd, chunk, sizeof(chunk), off);
+        }
+        double secs = now() - t;
+        long reads = get_cache_stats().disk_reads - reads_before;
+        readahead_stats_t ra = sfs_get_readahead_stats();
+        sprintf(what, "readahead: %s, 4 KB chunks", on ? "on" : "off");
+        report(what, size / (int) sizeof(chunk), secs);
+        fprintf(stderr, "readahead: %s: %ld read_blocks calls, window %d blocks (max %d), %ld of %ld prefetched blocks hit\n",
+                on ? "on" : "off", reads, ra.window, ra.max_window, ra.blocks_hit, ra.blocks_prefetched);
+        sfs_fclose(fd);
+        close_disk();
+    }
+    sfs_set_readahead(READAHEAD_MAX_BLOCKS);
+    free(data);
+}
+
+/**
+ * Copies src to dst in 4 KB chunks the way the FUSE wrappers serve a cp. If reopen is set, every chunk
+ * opens the file by name and closes it again, as the wrappers used to; otherwise both files stay open
+ */
+void copy_file(char *src, char *dst, int size, int reopen) {
+    char chunk[4096];
+    int in = sfs_fopen(src);
+    int out = sfs_fopen(dst);
+    for (int off = 0; off < size; off += sizeof(chunk)) {
+        if (reopen) {
+            in = sfs_fopen(src);
+        }
+        int n = sfs_pread(in, chunk, sizeof(chunk), off);
+        if (reopen) {
+            sfs_fclose(in);
+            out = sfs_fopen(dst);
+        }
+        sfs_pwrite(out, chunk, n, off);
+        if (reopen) {
+            sfs_fclose(out);
+        }
+    }
+    if (!reopen) {
+        sfs_fclose(in);
+        sfs_fclose(out);
+    }
+}
+
+/**
+ * Times a 1 MB sequential copy, with files reopened for every 4 KB chunk and with files kept open.
+ * A file can hold at most MAX_FILE_SIZE bytes, so the megabyte is copied as four 256 KB files
+ */
+void bench_copy() {
+    const char *modes[] = { "reopen per chunk", "kept open" };
+    int size = 256 * 1024;
+    int files = 4;
+    char *data = malloc(size);
+    char src[MAXFILENAME];
+    char dst[MAXFILENAME];
+    char what[64];
+    memset(data, 'd', size);
+
+    for (int reopen = 1; reopen >= 0; reopen--) {
+        mksfs(1);
+        for (int f = 0; f < files; f++) {
+            sprintf(src, "src%d.bin", f);
+            int fd = sfs_fopen(src);
+            sfs_pwrite(fd, data, size, 0);
+            sfs_fclose(fd);
+        }
+        double t = now();
+        for (int f = 0; f < files; f++) {
+            sprintf(src, "src%d.bin", f);
+            sprintf(dst, "dst%d.bin", f);
+            copy_file(src, dst, size, reopen);
+        }
+        double secs = now() - t;
+        sprintf(what, "copy: 1 MB, %s", modes[1 - reopen]);
+        report(what, files * size / 4096, secs);
+        fprintf(stderr, "copy: %s: %.1f MB/s\n", modes[1 - reopen], files * size / secs / (1024 * 1024));
+        sfs_sync();
+        close_disk();
+    }
+    free(data);
+}
+
+/**
+ * One thread of bench_threads: fills its own file with its own byte in 4 KB sfs_pwrites, reads it back a few
+ * times in 4 KB sfs_preads, and counts the bytes that came back wrong
+ */
+typedef struct {
+    int id;
+    int ops;
+    int errors;
+} stress_thread_t;
+
+void *stress_thread(void *arg) {
+    stress_thread_t *t = arg;
+    char name[MAXFILENAME];
+    char data[4096];
+    char back[4096];
+    int chunks = 32;
+    sprintf(name, "stress%d.bin", t->id);
+    memset(data, 'A' + t->id, sizeof(data));
+
+    int fd = sfs_fopen(name);
+    for (int i = 0; i < chunks; i++) {
+        sfs_pwrite(fd, data, sizeof(data), i * sizeof(data));
+        t->ops++;
+    }
+    int64_t size = sfs_getfilesize(name);
+    for (int pass = 0; pass < 20; pass++) {
+        for (int off = 0; off + (int) sizeof(back) <= size; off += sizeof(back)) {
+            int n = sfs_pread(fd, back, sizeof(back), off);
+            for (int k = 0; k < n; k++) {
+                t->errors += (back[k] != data[0]);
+            }
+            t->ops++;
+        }
+    }
+    sfs_fclose(fd);
+    sfs_remove(name);
+    t->ops += 2;
+    return NULL;
+}
+
+/**
+ * One thread of the cold part of bench_threads: reads its file, written by stress_thread, once in 4 KB sfs_preads
+ * from a freshly opened disk, so every read misses the block cache
+ */
+void *cold_read_thread(void *arg) {
+    stress_thread_t *t = arg;
+    char name[MAXFILENAME];
+    char back[4096];
+    sprintf(name, "stress%d.bin", t->id);
+
+    int fd = sfs_fopen(name);
+    int64_t size = sfs_getfilesize(name);
+    for (int off = 0; off + (int) sizeof(back) <= size; off += sizeof(back)) {
+        int n = sfs_pread(fd, back, sizeof(back), off);
+        for (int k = 0; k < n; k++) {
+            t->errors += (back[k] != 'A' + t->id);
+        }
+        t->ops++;
+    }
+    sfs_fclose(fd);
+    return NULL;
+}
+
+/**
+ * Runs stress_thread on 1, 2, 4 and 8 threads at once, each on its own file, and reports the combined throughput.
+ * Then has as many threads read their files cold from the modelled SSD on a real clock, so each miss really waits
+ * out the device's time and the threads' misses only overlap if the block cache lets them. Readahead is off, so
+ * each read's own misses are measured
+ */
+void bench_threads() {
+    char what[64];
+    pthread_t threads[BENCH_MAX_THREADS];
+    stress_thread_t state[BENCH_MAX_THREADS];
+
+    for (int n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+        mksfs(1);
+        memset(state, 0, sizeof(state));
+        double t = now();
+        for (int i = 0; i < n; i++) {
+            state[i].id = i;
+            pthread_create(&threads[i], NULL, stress_thread, &state[i]);
+        }
+        int ops = 0;
+        int errors = 0;
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+            ops += state[i].ops;
+            errors += state[i].errors;
+        }
+        sprintf(what, "threads: %d thread(s), 4 KB ops", n);
+        report(what, ops, now() - t);
+        if (errors != 0) {
+            fprintf(stderr, "threads: %d bytes read back wrong\n", errors);
+        }
+        sfs_sync();
+        close_disk();
+    }
+
+    device_model_t ssd = DEVICE_SSD;
+    ssd.virtual_clock = 0;
+    for (int n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+        mksfs(1);
+        memset(state, 0, sizeof(state));
+        for (int i = 0; i < n; i++) {
+            char name[MAXFILENAME];
+            char data[4096];
+            sprintf(name, "stress%d.bin", i);
+            memset(data, 'A' + i, sizeof(data));
+            int fd = sfs_fopen(name);
+            for (int c = 0; c < 32; c++) {
+                sfs_pwrite(fd, data, sizeof(data), c * sizeof(data));
+            }
+            sfs_fclose(fd);
+        }
+        sfs_sync();
+        close_disk();
+
+        mksfs(0);
+        sfs_set_readahead(0);
+        set_device_model(&ssd);
+        double t = now();
+        for (int i = 0; i < n; i++) {
+            state[i].id = i;
+            pthread_create(&threads[i], NULL, cold_read_thread, &state[i]);
+        }
+        int ops = 0;
+        int errors = 0;
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+            ops += state[i].ops;
+            errors += state[i].errors;
+        }
+        sprintf(what, "threads: %d thread(s), cold ssd reads", n);
+        report(what, ops, now() - t);
+        if (errors != 0) {
+            fprintf(stderr, "threads: %d bytes read back wrong\n", errors);
+        }
+        set_device_model(NULL);
+        sfs_set_readahead(READAHEAD_MAX_BLOCKS);
+        close_disk();
+    }
+}
+
+typedef struct {
+    const char *name;
+    void (*run)();
+} benchmark_t;
+
+benchmark_t benchmarks[] = {
+    { "disk", bench_disk },
+    { "cache", bench_cache },
+    { "lookup", bench_lookup },
+    { "alloc", bench_alloc },
+    { "threads", bench_threads },
+    { "copy", bench_copy },
+    { "copies", bench_copies },
+    { "readahead", bench_readahead },
+    { "appends", bench_appends },
+    { "indirect", bench_indirect },
+    { "sparse", bench_sparse },
+    { "geometry", bench_geometry },
+    { "large", bench_large },
+    { "mkfs", bench_mkfs },
+    { "async", bench_async },
+    { "device", bench_device },
+    { "durability", bench_durability },
+    { "vectored", bench_vectored },
+    { "inline", bench_inline },
+};
+
+int main(int argc, char *argv[]) {
+    int n = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    if (argc != 2) {
+        printf("Usage: %s <benchmark>\nBenchmarks:", argv[0]);
+        for (int i = 0; i < n; i++) {
+            printf(" %s", benchmarks[i].name);
+        }
+        printf("\n");
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (strcmp(argv[1], benchmarks[i].name) == 0) {
+            benchmarks[i].run();
+            return 0;
+        }
+    }
+    printf("Error: unknown benchmark %s\n", argv[1]);
+    return 1;
+}